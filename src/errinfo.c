@@ -8,8 +8,9 @@
 
 #include "errinfo.h"
 
-static const char *errstr = 0;
-static int errloc = -1;
+// per thread, so concurrently running targets don't clobber each other
+static __thread const char *errstr = 0;
+static __thread int errloc = -1;
 
 void set_errinfo (const char *str, int loc)
 {
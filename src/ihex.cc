@@ -9,46 +9,62 @@
 #include "ihex.h"
 #include "errinfo.h"
 #include <string>
-#include <vector>
+
+// returns the value of a two-digit hex field, or -1 if it isn't one
+static inline int hexbyte (const char *p)
+{
+  int v = 0;
+  for (int i = 0; i < 2; ++i)
+  {
+    char c = p[i];
+    v <<= 4;
+    if (c >= '0' && c <= '9')      v |= c - '0';
+    else if (c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+    else return -1;
+  }
+  return v;
+}
+
 
 bool load_ihex (std::istream &is, page_map_512_t &pages)
 {
   uint32_t addr_upper = 0;
   std::string line;
   unsigned lineno = 0;
-  while (std::getline (is, line) && line.size () >= 11)
+  uint8_t data[255];
+  while (std::getline (is, line))
   {
     line.erase (line.find_last_not_of (" \n\r\t") +1);
+    if (line.size () < 11)
+      break;
 
-    uint8_t sum = 0;
-
-    uint8_t count;
-    uint8_t addr_hi;
-    uint8_t addr_lo;
-    uint8_t type;
-    if (sscanf (
-          line.c_str (), ":%02hhx%02hhx%02hhx%02hhx",
-          &count, &addr_hi, &addr_lo, &type) != 4)
+    const char *rec = line.c_str ();
+    int fields[4];
+    for (int f = 0; f < 4; ++f)
+      fields[f] = hexbyte (rec + 1 + 2*f);
+    if (rec[0] != ':' ||
+        fields[0] < 0 || fields[1] < 0 || fields[2] < 0 || fields[3] < 0)
       return_errinfoloc (false, "malformed ihex record at line", lineno);
-    if (line.size () != (11 + 2*count))
-      return_errinfoloc (false, "ihex record length error at line", lineno);
 
-    sum += count;
-    sum += addr_hi;
-    sum += addr_lo;
-    sum += type;
+    uint8_t count = fields[0];
+    uint8_t addr_hi = fields[1];
+    uint8_t addr_lo = fields[2];
+    uint8_t type = fields[3];
+    if (line.size () != (11u + 2*count))
+      return_errinfoloc (false, "ihex record length error at line", lineno);
 
-    std::vector<uint8_t> data;
-    uint8_t byte;
+    uint8_t sum = count + addr_hi + addr_lo + type;
     for (unsigned i = 0; i < count; ++i)
     {
-      if (sscanf (line.c_str () + 9 + 2*i, "%02hhx", &byte) != 1)
+      int byte = hexbyte (rec + 9 + 2*i);
+      if (byte < 0)
         return_errinfoloc (false, "bad ihex data at line", lineno);
-      data.push_back (byte);
+      data[i] = byte;
       sum += byte;
     }
-    uint8_t checksum;
-    if (sscanf (line.c_str () + line.size () -2, "%02hhx", &checksum) != 1)
+    int checksum = hexbyte (rec + line.size () -2);
+    if (checksum < 0)
       return_errinfoloc (false, "failed to read checksum field at line", lineno);
     sum += checksum;
     if (sum)
@@ -58,27 +74,38 @@ bool load_ihex (std::istream &is, page_map_512_t &pages)
     {
       case 0x00:
       {
-        uint16_t addr = ((uint16_t)addr_hi << 8) | addr_lo;
+        if (!count)
+          break; // don't conjure up an erased page
+        // type 02 bases are only 16 byte aligned, so split the full address
+        uint32_t addr = addr_upper + (((uint16_t)addr_hi << 8) | addr_lo);
         int16_t  offs = addr % 512;
-        uint32_t pgaddr = addr_upper + addr - offs;
+        uint32_t pgaddr = addr - offs;
         auto *pg = &pages[pgaddr];
         pg->addr = pgaddr;
-        for (size_t i = 0; i < data.size (); ++i)
+        for (size_t i = 0; i < count; ++i)
         {
           if (offs + i == 512) // argh, page boundary!
           {
             pgaddr += 512;
             offs -= 512;
             pg = &pages[pgaddr];
+            pg->addr = pgaddr;
           }
           pg->data[offs + i] = data[i];
         }
         break;
       }
       case 0x01: return true; // EOF
-      case 0x02: addr_upper = (data[0] << 12) | (data[1] << 4);  break;
+      case 0x02:
+      case 0x04:
+        if (count != 2)
+          return_errinfoloc (false, "bad extended address record at line", lineno);
+        if (type == 0x02)
+          addr_upper = ((uint32_t)data[0] << 12) | (data[1] << 4);
+        else
+          addr_upper = ((uint32_t)data[0] << 24) | (data[1] << 16);
+        break;
       case 0x03: break; // cs:ip, ignore
-      case 0x04: addr_upper = (data[0] << 24) | (data[1] << 16); break;
       case 0x05: break; // eip, ignore
     }
 
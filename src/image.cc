@@ -0,0 +1,283 @@
+/* Copyright (C) 2015 DiUS Computing Pty. Ltd.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#include "image.h"
+#include "errinfo.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <fstream>
+
+
+uint32_t page_crc (const char *data, size_t len)
+{
+  static uint32_t table[256];
+  if (!table[1])
+  {
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+      uint32_t c = i;
+      for (int b = 0; b < 8; ++b)
+        c = (c >> 1) ^ (0xedb88320 & -(c & 1));
+      table[i] = c;
+    }
+  }
+
+  uint32_t crc = 0xffffffff;
+  for (size_t i = 0; i < len; ++i)
+    crc = (crc >> 8) ^ table[(crc ^ (uint8_t)data[i]) & 0xff];
+  return ~crc;
+}
+
+
+uint64_t page_hash (const char *data, size_t len)
+{
+  uint64_t h = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < len; ++i)
+  {
+    h ^= (uint8_t)data[i];
+    h *= 0x100000001b3ull;
+  }
+  return h;
+}
+
+
+// Both compare a word at a time once aligned to b. The targets and the Pi
+// are little endian, so the lowest differing (or agreeing) byte of a word
+// comes first.
+size_t first_diff (const char *a, const char *b, size_t from, size_t len)
+{
+  size_t i = from;
+  for (; i < len && (uintptr_t)(b + i) % 8; ++i)
+    if (a[i] != b[i])
+      return i;
+  for (; i + 8 <= len; i += 8)
+  {
+    uint64_t x, y;
+    memcpy (&x, a + i, 8);
+    memcpy (&y, b + i, 8);
+    if (x != y)
+      return i + __builtin_ctzll (x ^ y) / 8;
+  }
+  for (; i < len; ++i)
+    if (a[i] != b[i])
+      return i;
+  return len;
+}
+
+
+size_t first_same (const char *a, const char *b, size_t from, size_t len)
+{
+  const uint64_t ones = 0x0101010101010101ull, highs = 0x8080808080808080ull;
+  size_t i = from;
+  for (; i < len && (uintptr_t)(b + i) % 8; ++i)
+    if (a[i] == b[i])
+      return i;
+  for (; i + 8 <= len; i += 8)
+  {
+    uint64_t x, y;
+    memcpy (&x, a + i, 8);
+    memcpy (&y, b + i, 8);
+    uint64_t d = x ^ y; // a zero byte where they agree
+    uint64_t zero = (d - ones) & ~d & highs;
+    if (zero)
+      return i + __builtin_ctzll (zero) / 8;
+  }
+  for (; i < len; ++i)
+    if (a[i] == b[i])
+      return i;
+  return len;
+}
+
+
+page_list_t page_refs (const page_map_512_t &pages)
+{
+  page_list_t list;
+  list.reserve (pages.size ());
+  for (auto &i : pages)
+  {
+    page_ref_t ref = { i.first, i.second.data, 0 };
+    list.push_back (ref);
+  }
+  return list;
+}
+
+
+void page_entries (page_list_t &pages, std::vector<image_page_t> &entries)
+{
+  entries.resize (pages.size ());
+  for (size_t i = 0; i < pages.size (); ++i)
+  {
+    image_page_t &e = entries[i];
+    e.addr = pages[i].addr;
+    e.crc = page_crc (pages[i].data, IMAGE_PAGE_SIZE);
+    e.hash = page_hash (pages[i].data, IMAGE_PAGE_SIZE);
+    pages[i].entry = &e;
+  }
+}
+
+
+bool compile_image (
+  const page_map_512_t &pages, uint32_t base, const char *fname)
+{
+  image_hdr_t hdr;
+  memset (&hdr, 0, sizeof (hdr));
+  memcpy (hdr.magic, IMAGE_MAGIC, sizeof (hdr.magic));
+  hdr.version = IMAGE_VERSION;
+  hdr.page_size = IMAGE_PAGE_SIZE;
+  hdr.base = base;
+  hdr.npages = pages.size ();
+  hdr.span_pages =
+    pages.empty () ? 0 : pages.rbegin ()->first / IMAGE_PAGE_SIZE + 1;
+
+  std::vector<uint8_t> bitmap ((hdr.span_pages + 7) / 8);
+  std::vector<image_page_t> table;
+  for (auto &i : pages)
+  {
+    uint32_t n = i.first / IMAGE_PAGE_SIZE;
+    bitmap[n / 8] |= 1 << (n % 8);
+    image_page_t p;
+    p.addr = i.first;
+    p.crc = page_crc (i.second.data, IMAGE_PAGE_SIZE);
+    p.hash = page_hash (i.second.data, IMAGE_PAGE_SIZE);
+    table.push_back (p);
+  }
+
+  size_t meta = sizeof (hdr) + bitmap.size () +
+    table.size () * sizeof (image_page_t);
+  hdr.payload_offs = (meta + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN;
+
+  std::ofstream out (fname, std::ios::binary | std::ios::trunc);
+  out.write ((const char *)&hdr, sizeof (hdr));
+  out.write ((const char *)bitmap.data (), bitmap.size ());
+  out.write (
+    (const char *)table.data (), table.size () * sizeof (image_page_t));
+  std::vector<char> pad (hdr.payload_offs - meta);
+  out.write (pad.data (), pad.size ());
+  for (auto &i : pages)
+    out.write (i.second.data, IMAGE_PAGE_SIZE);
+  out.close ();
+  if (!out)
+    return_errinfo (false, "failed to write compiled image");
+  return true;
+}
+
+
+bool image_is_compiled (const char *fname)
+{
+  char magic[8];
+  FILE *f = fopen (fname, "rb");
+  if (!f)
+    return false;
+  bool is = fread (magic, 1, sizeof (magic), f) == sizeof (magic) &&
+    memcmp (magic, IMAGE_MAGIC, sizeof (magic)) == 0;
+  fclose (f);
+  return is;
+}
+
+
+bool map_image (const char *fname, mapped_image_t &img, page_list_t &pages)
+{
+  memset (&img, 0, sizeof (img));
+  int fd = open (fname, O_RDONLY);
+  if (fd < 0)
+    return_errinfo (false, "failed to open compiled image");
+  struct stat st;
+  if (fstat (fd, &st) != 0)
+  {
+    close (fd);
+    return_errinfo (false, "failed to open compiled image");
+  }
+  img.len = st.st_size;
+  if (img.len < sizeof (image_hdr_t))
+  {
+    close (fd);
+    return_errinfo (false, "compiled image truncated");
+  }
+  // mlockall() in pdi_open() faults the mapping in, so programming from it
+  // won't page fault
+  img.map = mmap (0, img.len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (img.map == MAP_FAILED)
+  {
+    img.map = 0;
+    return_errinfo (false, "failed to map compiled image");
+  }
+
+  const char *p = (const char *)img.map;
+  img.hdr = (const image_hdr_t *)p;
+  const image_hdr_t &h = *img.hdr;
+  size_t bitmap_len = ((size_t)h.span_pages + 7) / 8;
+  size_t meta = sizeof (h) + bitmap_len +
+    (size_t)h.npages * sizeof (image_page_t);
+  const char *err = 0;
+  if (memcmp (h.magic, IMAGE_MAGIC, sizeof (h.magic)) != 0 ||
+      h.version != IMAGE_VERSION)
+    err = "unsupported compiled image version";
+  else if (h.page_size != IMAGE_PAGE_SIZE)
+    err = "compiled image page size mismatch";
+  else if (h.npages > h.span_pages || h.payload_offs % IMAGE_ALIGN ||
+           h.payload_offs < meta ||
+           h.payload_offs + (uint64_t)h.npages * IMAGE_PAGE_SIZE > img.len)
+    err = "compiled image truncated or corrupt";
+  if (err)
+  {
+    unmap_image (img);
+    return_errinfo (false, err);
+  }
+
+  img.bitmap = (const uint8_t *)(p + sizeof (h));
+  img.pages = (const image_page_t *)(img.bitmap + bitmap_len);
+  img.payload = p + h.payload_offs;
+
+  pages.clear ();
+  pages.reserve (h.npages);
+  for (uint32_t i = 0; i < h.npages; ++i)
+  {
+    const image_page_t &ip = img.pages[i];
+    const char *data = img.payload + (size_t)i * IMAGE_PAGE_SIZE;
+    uint32_t n = ip.addr / IMAGE_PAGE_SIZE;
+    if (ip.addr % IMAGE_PAGE_SIZE || n >= h.span_pages ||
+        !(img.bitmap[n / 8] & (1 << (n % 8))) ||
+        (i && ip.addr <= img.pages[i - 1].addr) ||
+        ip.crc != page_crc (data, IMAGE_PAGE_SIZE))
+    {
+      unmap_image (img);
+      return_errinfoloc (false, "compiled image corrupt at page", i);
+    }
+    page_ref_t ref = { ip.addr, data, &ip };
+    pages.push_back (ref);
+  }
+  return true;
+}
+
+
+void unmap_image (mapped_image_t &img)
+{
+  if (img.map)
+    munmap (img.map, img.len);
+  memset (&img, 0, sizeof (img));
+}
+
+
+bool load_image (
+  const char *fname, page_map_512_t &storage, mapped_image_t &img,
+  page_list_t &pages)
+{
+  if (image_is_compiled (fname))
+    return map_image (fname, img, pages);
+
+  memset (&img, 0, sizeof (img));
+  std::ifstream in (fname);
+  if (!load_ihex (in, storage))
+    return false;
+  pages = page_refs (storage);
+  return true;
+}
@@ -0,0 +1,99 @@
+/* Copyright (C) 2015 DiUS Computing Pty. Ltd.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#ifndef _IMAGE_H_
+#define _IMAGE_H_
+
+#include "ihex.h"
+#include <vector>
+
+#define IMAGE_PAGE_SIZE 512
+
+// Compiled image file layout, all little endian:
+//   image_hdr_t
+//   occupancy bitmap, a bit per page from offset 0 to the last page, lsb first
+//   image_page_t for each present page, in address order
+//   zero padding up to payload_offs (a multiple of IMAGE_ALIGN)
+//   the page data, IMAGE_PAGE_SIZE bytes per present page, in the same order
+#define IMAGE_MAGIC   "PDIIMAGE"
+#define IMAGE_VERSION 1
+#define IMAGE_ALIGN   4096
+
+struct image_hdr_t
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t page_size;
+  uint32_t base;         // flash base address the image was compiled for
+  uint32_t span_pages;   // pages covered by the bitmap
+  uint32_t npages;       // pages present
+  uint32_t payload_offs;
+};
+
+struct image_page_t
+{
+  uint32_t addr;
+  uint32_t crc;  // CRC-32 (IEEE 802.3) of the page data
+  uint64_t hash; // FNV-1a, 64 bit
+};
+
+// A page to program. The data is owned elsewhere: a page map loaded from
+// ihex, or a mapped compiled image. So is the entry, which if given holds
+// the CRC and hash of the data.
+struct page_ref_t
+{
+  uint32_t addr; // relative to the flash base
+  const char *data;
+  const image_page_t *entry;
+};
+
+typedef std::vector<page_ref_t> page_list_t;
+
+struct mapped_image_t
+{
+  void *map;
+  size_t len;
+  const image_hdr_t *hdr;
+  const uint8_t *bitmap;
+  const image_page_t *pages;
+  const char *payload;
+};
+
+uint32_t page_crc (const char *data, size_t len);
+uint64_t page_hash (const char *data, size_t len);
+
+// the first offset in [from, len) where a and b differ, or len; and the
+// first one where they agree again, for finding the extent of a difference
+size_t first_diff (const char *a, const char *b, size_t from, size_t len);
+size_t first_same (const char *a, const char *b, size_t from, size_t len);
+
+// references to all pages of a page map, which must outlive the list
+page_list_t page_refs (const page_map_512_t &pages);
+
+// works out the CRC and hash of each page into entries, which must then
+// outlive the list, and points the pages at them; compiled images come
+// with theirs
+void page_entries (page_list_t &pages, std::vector<image_page_t> &entries);
+
+bool compile_image (
+  const page_map_512_t &pages, uint32_t base, const char *fname);
+
+bool image_is_compiled (const char *fname);
+
+// maps and validates a compiled image; pages then point into the mapping
+bool map_image (const char *fname, mapped_image_t &img, page_list_t &pages);
+
+void unmap_image (mapped_image_t &img);
+
+// loads either kind of image file; storage backs ihex pages, img compiled
+// ones (img.map is null otherwise)
+bool load_image (
+  const char *fname, page_map_512_t &storage, mapped_image_t &img,
+  page_list_t &pages);
+
+#endif
@@ -6,23 +6,38 @@
    (at your option) any later version.
 */
 
+#include "xmegapdi.h"
 extern "C" {
-#include "pdi.h"
 #include "nvm.h"
 }
 #include "ihex.h"
 #include "errinfo.h"
+#include "telemetry.h"
+#include "watch.h"
 #include <sys/signal.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <getopt.h>
 #include <time.h>
+#include <unistd.h>
 #include <fstream>
+#include <string>
+#include <vector>
+
+#define MAX_TARGETS 8
+
+static volatile sig_atomic_t stopping = 0;
+static pdi_ctx_t *volatile contexts[MAX_TARGETS];
 
 void on_sig (int sig)
 {
   signal (sig, SIG_DFL);
-  pdi_stop ();
+  stopping = 1;
+  for (unsigned i = 0; i < MAX_TARGETS; ++i)
+    if (contexts[i])
+      pdi_stop (contexts[i]);
 }
 
 void dump (uint32_t addr, char *p, uint32_t len)
@@ -72,8 +87,10 @@ int error_out (int code)
 void syntax (const char *name)
 {
   fprintf (stderr,
-    "syntax: %s [-h] [-q] [-a baseaddr] [-b] [-c clkpin] [-d datapin] [-s pdidelay] [-D len@offs] [-E] [-F ihexfile]\n\n"
+    "syntax: %s [-h] [-q] [-n] [-a baseaddr] [-b] [-c clkpin] [-d datapin] [-s pdidelay] [-D len@offs] [-E] [-e] [-F ihexfile] [-T shmname] [-t tracefile] [-L] [-N serial@offs[:len]] [-U] [-m clk,data,ihexfile]... [-S] [-W addr:size[,...]] [-o outfile] [-C count] [-M manifestdir] [-V [-x] [-R]]\n\n"
     "  -q             quiet mode\n"
+    "  -n, --dry-run  don't touch the target; estimate how long the given\n"
+    "                 actions would take at the selected PDI clock delay\n"
     "  -a baseaddr    override base address (note: PDI address space)\n"
     "  -b             use default boot flash instead of app flash address\n"
     "  -c clkpin      set gpio pin to use as PDI_CLK\n"
@@ -81,20 +98,480 @@ void syntax (const char *name)
     "  -s pdidelay    set PDI clock delay, in us\n"
     "  -D len@offs    dump memory, len bytes from (baseaddr + offs)\n"
     "  -E             perform chip erase\n"
-    "  -F ihexfile    write ihexfile\n"
+    "  -e             allow erasing the target (app or boot) section first,\n"
+    "                 when that is faster\n"
+    "  -F ihexfile    write ihexfile, or an image compiled with \"compile\"\n"
+    "  -T shmname     publish progress telemetry in POSIX shm object shmname\n"
+    "  -t tracefile   capture PDI bus trace to tracefile (see pdi-trace)\n"
+    "  -L             station mode: program+verify boards in a loop\n"
+    "  -N serial@offs[:len] patch len-byte serial number at (baseaddr + offs)\n"
+    "                 per unit in station mode, incremented after each unit\n"
+    "  -U             patch the serial into the user signature row instead\n"
+    "  -m clk,data,ihexfile  program ihexfile into the target on the given\n"
+    "                 gpio pins; repeat to program several targets at once\n"
+    "  -S             clock all -m targets in lock-step from a single core;\n"
+    "                 the default when there are more targets than spare cores,\n"
+    "                 unless -M is given\n"
+    "  -W addr:size[,addr:size]...  sample the given data space locations\n"
+    "                 (sram, i/o registers) as fast as possible, while the\n"
+    "                 target keeps running; stop with Ctrl-C\n"
+    "  -o outfile     write watch samples to outfile, in binary\n"
+    "  -C count       stop watching after count samples\n"
+    "  -M manifestdir keep a manifest of what was written to each device in\n"
+    "                 manifestdir, and skip programming unchanged pages\n"
+    "  -V             verify the target(s) against the -F or -m image(s)\n"
+    "                 instead of programming, reporting every difference\n"
+    "  -x             with -V, stop at the first differing page\n"
+    "  -R             with -V, rewrite differing pages and check them again\n"
     "  -h             show this help\n"
     "\n"
-    , name);
+    "       %s compile [-a baseaddr] [-b] ihexfile imagefile\n\n"
+    "  precompiles ihexfile for faster loading; a compiled image can be\n"
+    "  given wherever an ihexfile is expected\n"
+    "\n"
+    , name, name);
   exit (-1);
 }
 
+#define TRACE_RECORDS (4*1024*1024) // 16MB, plenty for a full 256k image
+
+#define PROBE_INTERVAL_US    250000
+
 #define bail_out(retval) \
   do { ret = retval; goto out; } while (0)
 
 
+// prints what the dry run clocked, broken down by phase
+static void print_estimate (pdi_ctx_t *ctx, uint32_t delay_us)
+{
+  double bit_us = 2.0 * delay_us + PDI_BIT_OVERHEAD_NS / 1000.0;
+  pdi_stats_t total = pdi_stats_t ();
+  printf ("%-8s %10s %10s %8s %10s %10s %10s\n", "phase",
+    "frames-out", "frames-in", "dir-sw", "idle-clk", "link-ms", "busy-ms");
+  for (uint32_t phase = 0; phase < PDI_STATS_PHASES; ++phase)
+  {
+    pdi_stats_t st;
+    pdi_get_stats (ctx, phase, &st);
+    if (!st.sequences && !st.idle_clocks && !st.busy_us)
+      continue;
+    uint64_t clocks =
+      (st.frames_out + st.frames_in) * PDI_FRAME_BITS + st.idle_clocks;
+    printf ("%-8s %10llu %10llu %8llu %10llu %10.1f %10.1f\n",
+      telemetry_phase_name (phase),
+      (unsigned long long)st.frames_out, (unsigned long long)st.frames_in,
+      (unsigned long long)st.dir_switches, (unsigned long long)st.idle_clocks,
+      clocks * bit_us / 1000, st.busy_us / 1000.0);
+    total.frames_out += st.frames_out;
+    total.frames_in += st.frames_in;
+    total.dir_switches += st.dir_switches;
+    total.idle_clocks += st.idle_clocks;
+    total.busy_us += st.busy_us;
+  }
+  uint64_t clocks =
+    (total.frames_out + total.frames_in) * PDI_FRAME_BITS + total.idle_clocks;
+  double link_ms = clocks * bit_us / 1000;
+  printf ("%-8s %10llu %10llu %8llu %10llu %10.1f %10.1f\n", "total",
+    (unsigned long long)total.frames_out, (unsigned long long)total.frames_in,
+    (unsigned long long)total.dir_switches,
+    (unsigned long long)total.idle_clocks, link_ms, total.busy_us / 1000.0);
+  printf ("Estimated time: %.3fs (%.3fs on the link, %.3fs NVM busy)\n",
+    (link_ms + total.busy_us / 1000.0) / 1000, link_ms / 1000,
+    total.busy_us / 1e6);
+}
+
+
+struct serial_patch_t
+{
+  bool enabled;
+  bool usersig;
+  uint64_t serial;
+  uint32_t offs;
+  unsigned len;
+};
+
+
+static void patch_serial (char *dst, const serial_patch_t &sp)
+{
+  for (unsigned i = 0; i < sp.len; ++i)
+    dst[i] = (sp.serial >> (8 * i)) & 0xff; // little endian, like avr-gcc
+}
+
+
+// points the image's serial page at a private copy in buf, adding the page
+// if the image doesn't have it; the serial bytes start out zeroed so
+// planning treats the page as non-blank
+static void prepare_serial_page (
+  page_list_t &pages, const serial_patch_t &sp, char *buf)
+{
+  uint32_t pgaddr = sp.offs - sp.offs % IMAGE_PAGE_SIZE;
+  auto it = pages.begin ();
+  while (it != pages.end () && it->addr < pgaddr)
+    ++it;
+  if (it == pages.end () || it->addr != pgaddr)
+  {
+    memset (buf, 0xff, IMAGE_PAGE_SIZE);
+    page_ref_t ref = { pgaddr, buf, 0 };
+    it = pages.insert (it, ref);
+  }
+  else
+    memcpy (buf, it->data, IMAGE_PAGE_SIZE);
+  it->data = buf;
+  it->entry = 0; // changes with every serial
+  memset (buf + sp.offs % IMAGE_PAGE_SIZE, 0, sp.len);
+}
+
+
+// probes for a target at a low duty cycle until its presence equals want;
+// a wanted target is left open, we're about to program it. Waiting for one
+// to go away only checks the PDI answers, so the board isn't reset each time
+static bool wait_target (xpdi_session_t *s, bool want)
+{
+  telemetry_set_phase (pdi_telemetry (xpdi_ctx (s)), TM_IDLE);
+  while (!stopping)
+  {
+    bool present =
+      (want ? xpdi_probe (s, true) : xpdi_present (s)) == XPDI_OK;
+    if (present == want)
+      return true;
+    usleep (PROBE_INTERVAL_US);
+  }
+  return false;
+}
+
+
+// production line loop: the image is loaded and planned once, then each
+// board gets programmed, serial-patched and verified in turn
+static int run_station (
+  xpdi_session_t *s, const page_list_t &pages, const plan_t &base_plan,
+  serial_patch_t &sp, char *serial_page, bool quiet)
+{
+  // the page holding the serial is patched in place (see
+  // prepare_serial_page()), nothing else changes
+  char *serial_dst = 0;
+  if (sp.enabled && !sp.usersig)
+    serial_dst = serial_page + sp.offs % IMAGE_PAGE_SIZE;
+
+  unsigned units = 0, failures = 0;
+  struct timespec t_start, t0, t1;
+  clock_gettime (CLOCK_MONOTONIC, &t_start);
+  if (!quiet)
+    printf ("Station ready, waiting for target...\n");
+  fflush (stdout);
+
+  while (wait_target (s, true))
+  {
+    clock_gettime (CLOCK_MONOTONIC, &t0);
+    if (serial_dst)
+      patch_serial (serial_dst, sp);
+
+    plan_t plan = base_plan;
+    bool blank = false;
+    int ret = xpdi_program (s, pages, plan, &blank);
+    if (!ret && sp.enabled && sp.usersig)
+    {
+      char serial[8];
+      patch_serial (serial, sp);
+      ret = xpdi_patch_usersig (s, sp.offs, serial, sp.len);
+    }
+    if (!ret)
+      ret = xpdi_verify (s, pages);
+
+    int err = xpdi_close (s);
+    if (!ret)
+      ret = err;
+    clock_gettime (CLOCK_MONOTONIC, &t1);
+
+    if (stopping)
+      break;
+
+    // slow stuff is fine again until the next board turns up
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    double hours = ((t1.tv_sec - t_start.tv_sec) +
+      (t1.tv_nsec - t_start.tv_nsec) / 1e9) / 3600;
+    if (ret)
+    {
+      ++failures;
+      error_out (ret);
+      printf ("unit FAILED (%.1fs)", secs);
+    }
+    else
+    {
+      ++units;
+      printf ("unit %u ok", units);
+      if (sp.enabled)
+        printf (", serial %llu", (unsigned long long)sp.serial++);
+      printf (" (%.1fs, %s)", secs, blank ? "blank" : plan_name (plan.kind));
+      xpdi_manifest_status_t st;
+      if (xpdi_manifest_status (s, &st))
+        printf (", %u pages unchanged", st.skipped);
+    }
+    printf (", %u ok/%u failed, %.0f units/h\n", units, failures,
+      units / hours);
+    if (!quiet)
+      printf ("Remove board...\n");
+    fflush (stdout);
+
+    if (!wait_target (s, false))
+      break;
+    if (!quiet)
+      printf ("Waiting for target...\n");
+    fflush (stdout);
+  }
+
+  printf ("station stopped: %u ok, %u failed\n", units, failures);
+  return 0;
+}
+
+
+static void print_check (const xpdi_check_t &c)
+{
+  printf ("Verify: %u pages, %u differing", c.pages, c.bad_pages);
+  if (c.bad_pages)
+    printf (" (%u bytes in %u ranges)", c.bad_bytes, c.nranges);
+  if (c.reflashed)
+    printf (", %u rewritten", c.reflashed);
+  printf ("\n");
+  uint32_t n = c.nranges < XPDI_CHECK_MAX_RANGES ?
+    c.nranges : XPDI_CHECK_MAX_RANGES;
+  for (uint32_t i = 0; i < n; ++i)
+    printf ("  %06x-%06x (%u bytes)\n", c.ranges[i].addr,
+      c.ranges[i].addr + c.ranges[i].len - 1, c.ranges[i].len);
+  if (n < c.nranges)
+    printf ("  ...and %u more ranges\n", c.nranges - n);
+}
+
+
+static void print_manifest (xpdi_session_t *s)
+{
+  xpdi_manifest_status_t st;
+  if (!xpdi_manifest_status (s, &st))
+    return;
+  printf ("Device %s: %s, %u pages unchanged\n", st.device_id,
+    st.stale ? "manifest out of date" :
+    st.unchecked ? "known, but no range CRC to check the manifest (not an AU part)" :
+    st.known ? "known" : "new",
+    st.skipped);
+}
+
+
+// one target of a multi-target run, each programmed by its own RT thread,
+// or as a lane of a lock-step group
+struct target_t
+{
+  uint8_t clk, data;
+  std::string fname;
+  xpdi_image_t *img;
+  plan_t plan;
+  bool chip_erase;
+  bool verify;
+  unsigned check_flags;
+  xpdi_check_t check;
+
+  xpdi_session_t *s;
+  pthread_t thread;
+  int ret;
+  bool blank;
+  const char *err;
+  int errloc;
+};
+
+
+static void program_target (target_t *t)
+{
+  t->ret = xpdi_open (t->s);
+  if (!t->ret && t->chip_erase)
+    t->ret = xpdi_chip_erase (t->s);
+  if (!t->ret && t->verify)
+    t->ret = xpdi_check (
+      t->s, xpdi_image_pages (t->img), t->check_flags, &t->check);
+  else if (!t->ret)
+    t->ret = xpdi_program (t->s, xpdi_image_pages (t->img), t->plan, &t->blank);
+  int err = xpdi_close (t->s);
+  if (!t->ret)
+    t->ret = err;
+
+  get_errinfo (&t->err, &t->errloc); // errinfo is per thread (and lane)
+}
+
+
+static void *target_thread (void *arg)
+{
+  program_target ((target_t *)arg);
+  return 0;
+}
+
+
+static void target_lane (pdi_ctx_t *ctx, void *arg)
+{
+  (void)ctx;
+  program_target ((target_t *)arg);
+}
+
+
+// all targets on one thread: while one target's NVM controller is busy
+// writing a page, the others' pages are clocked out
+static void *group_thread (void *arg)
+{
+  std::vector<target_t> &targets = *(std::vector<target_t> *)arg;
+  pdi_group_t *g = pdi_group_init ();
+  for (auto &t : targets)
+  {
+    if (!g || !pdi_group_add (g, xpdi_ctx (t.s), target_lane, &t))
+    {
+      t.ret = 7;
+      t.err = "failed to set up lock-step group";
+      t.errloc = -1;
+    }
+  }
+  if (g)
+    pdi_group_run (g);
+  pdi_group_free (g);
+  return 0;
+}
+
+
+static bool can_lockstep (const std::vector<target_t> &targets)
+{
+  for (auto &t : targets)
+    if (t.clk >= 32) // clocked through the first gpio bank
+      return false;
+  return targets.size () <= PDI_GROUP_MAX_LANES;
+}
+
+
+// programs all targets concurrently, pinning each thread to its own core
+// (leaving core 0 to the rest of the system where possible); with more
+// targets than that, or if asked to, they share one thread in lock-step.
+// With manifests there are never more (see main()).
+static int run_targets (std::vector<target_t> &targets, bool lockstep)
+{
+  long ncpu = sysconf (_SC_NPROCESSORS_ONLN);
+  size_t spare = ncpu > 1 ? ncpu - 1 : 0;
+  if (!lockstep && targets.size () > 1 && targets.size () > spare)
+    lockstep = can_lockstep (targets);
+  if (!lockstep && ncpu > 1 && targets.size () > spare)
+    fprintf (stderr,
+      "warning: %zu targets but only %ld spare cores, targets will share\n",
+      targets.size (), ncpu - 1);
+
+  // a lock-step group is a single thread, on the first target's core
+  size_t nthreads = lockstep ? 1 : targets.size ();
+  pthread_t group;
+  bool group_started = false;
+  for (size_t i = 0; i < nthreads; ++i)
+  {
+    pthread_attr_t attr;
+    pthread_attr_init (&attr);
+    if (ncpu > 1)
+    {
+      cpu_set_t cpus;
+      CPU_ZERO (&cpus);
+      CPU_SET (1 + i % (ncpu - 1), &cpus);
+      pthread_attr_setaffinity_np (&attr, sizeof (cpus), &cpus);
+    }
+    int err = lockstep ?
+      pthread_create (&group, &attr, group_thread, &targets) :
+      pthread_create (&targets[i].thread, &attr, target_thread, &targets[i]);
+    pthread_attr_destroy (&attr);
+    if (err)
+    {
+      size_t from = lockstep ? 0 : i, to = lockstep ? targets.size () : i + 1;
+      for (size_t j = from; j < to; ++j)
+      {
+        targets[j].ret = 7;
+        targets[j].err = "failed to start target thread";
+        targets[j].errloc = -1;
+      }
+    }
+    else if (lockstep)
+      group_started = true;
+  }
+  if (group_started)
+    pthread_join (group, 0);
+
+  int ret = 0;
+  for (size_t i = 0; i < targets.size (); ++i)
+  {
+    target_t &t = targets[i];
+    if (!lockstep && t.ret != 7)
+      pthread_join (t.thread, 0);
+    printf ("target %zu (clk=gpio%d, data=gpio%d, %s): ",
+      i, t.clk, t.data, t.fname.c_str ());
+    if (t.ret)
+    {
+      set_errinfo (t.err, t.errloc);
+      error_out (t.ret);
+      printf ("FAILED\n");
+      ret = t.ret;
+    }
+    else if (t.verify)
+      printf ("ok (verified)\n");
+    else
+      printf ("ok (%s)\n", t.blank ? "blank" : plan_name (t.plan.kind));
+    if (t.verify && (!t.ret || t.ret == XPDI_ERR_VERIFY))
+      print_check (t.check);
+    if (!t.ret)
+      print_manifest (t.s);
+  }
+  return ret;
+}
+
+
+// a compiled image carries the base it was built for; adopt it unless one
+// was given, and refuse to program it anywhere else
+static bool adopt_image_base (
+  const xpdi_image_t *img, uint32_t *flash_base, bool *base_set)
+{
+  uint32_t base;
+  if (!xpdi_image_base (img, &base))
+    return true;
+  if (*base_set && base != *flash_base)
+    return_errinfo (false, "compiled image is for a different base address");
+  *flash_base = base;
+  *base_set = true;
+  return true;
+}
+
+
+// pdi compile [-a baseaddr] [-b] ihexfile imagefile
+static int compile_main (int argc, char *argv[], const char *name)
+{
+  uint32_t flash_base = 0x800000;
+  int opt;
+  while ((opt = getopt (argc, argv, "a:bh")) != -1)
+  {
+    switch (opt)
+    {
+      case 'a': flash_base = strtoul (optarg, 0, 0); break;
+      case 'b': flash_base = 0x840000; break;
+      default:
+        fprintf (stderr,
+          "syntax: %s compile [-a baseaddr] [-b] ihexfile imagefile\n", name);
+        exit (-1);
+    }
+  }
+  if (argc - optind != 2)
+  {
+    fprintf (stderr,
+      "syntax: %s compile [-a baseaddr] [-b] ihexfile imagefile\n", name);
+    exit (-1);
+  }
+
+  page_map_512_t pages;
+  std::ifstream in (argv[optind]);
+  if (!load_ihex (in, pages))
+    return error_out (2);
+  if (!compile_image (pages, flash_base, argv[optind + 1]))
+    return error_out (8);
+  printf ("%zu pages, base 0x%08x\nok\n", pages.size (), flash_base);
+  return 0;
+}
+
+
 int main (int argc, char *argv[])
 {
-  (void)argc; (void)argv;
+  if (argc > 1 && strcmp (argv[1], "compile") == 0)
+    return compile_main (argc - 1, argv + 1, argv[0]);
 
   int ret = 0;
 
@@ -104,6 +581,7 @@ int main (int argc, char *argv[])
 
   bool quiet = false;
   uint32_t flash_base = 0x800000;
+  bool base_set = false;
   uint8_t  clk_pin = 24, data_pin = 21; // j8.18, j8.40
   uint32_t pdi_delay_us = 0;
 
@@ -111,20 +589,41 @@ int main (int argc, char *argv[])
   uint32_t dump_addr = 0, dump_len = 0;
   const char *fname = 0;
   bool chip_erase = false;
+  bool section_erase = false;
+  const char *tm_name = 0;
+  const char *trace_fname = 0;
+  const char *manifest_dir = 0;
+  bool station = false;
+  bool dry_run = false;
+  std::vector<watch_entry_t> watch_list;
+  const char *watch_fname = 0;
+  uint64_t watch_count = 0;
+  serial_patch_t serial_patch = { false, false, 0, 0, 4 };
+  std::vector<target_t> targets;
+  bool lockstep = false;
+  bool verify = false;
+  unsigned check_flags = 0;
 
   page_map_512_t page_map;
 
+  static const struct option long_opts[] = {
+    { "dry-run", no_argument, 0, 'n' },
+    { 0, 0, 0, 0 }
+  };
+
   int opt;
-  while ((opt = getopt (argc, argv, "a:bc:d:h:s:qD:F:E")) != -1)
+  while ((opt = getopt_long (
+    argc, argv, "a:bc:d:h:s:qnD:F:EeT:t:LN:Um:SW:o:C:M:VxR", long_opts, 0)) != -1)
   {
     switch (opt)
     {
-      case 'a': flash_base = strtoul (optarg, 0, 0); break;
-      case 'b': flash_base = 0x840000; break; // bootarea for x256
+      case 'a': flash_base = strtoul (optarg, 0, 0); base_set = true; break;
+      case 'b': flash_base = 0x840000; base_set = true; break; // x256 boot
       case 'c': clk_pin = atoi (optarg); break;
       case 'd': data_pin = atoi (optarg); break;
       case 's': pdi_delay_us = strtoul (optarg, 0, 0); break;
       case 'q': quiet = true; break;
+      case 'n': dry_run = true; break;
       case 'D':
       {
         dump_mem = true;
@@ -138,27 +637,206 @@ int main (int argc, char *argv[])
       }
       case 'F': fname = optarg; break;
       case 'E': chip_erase = true; break;
+      case 'e': section_erase = true; break;
+      case 'T': tm_name = optarg; break;
+      case 't': trace_fname = optarg; break;
+      case 'L': station = true; break;
+      case 'N':
+      {
+        serial_patch.enabled = true;
+        serial_patch.serial = strtoull (optarg, 0, 0);
+        const char *offs = strchr (optarg, '@');
+        if (!offs)
+          syntax (argv[0]);
+        serial_patch.offs = strtoul (offs + 1, 0, 0);
+        const char *len = strchr (offs, ':');
+        if (len)
+          serial_patch.len = strtoul (len + 1, 0, 0);
+        break;
+      }
+      case 'U': serial_patch.usersig = true; break;
+      case 'm':
+      {
+        target_t t = target_t ();
+        char *end;
+        t.clk = strtoul (optarg, &end, 0);
+        if (*end != ',')
+          syntax (argv[0]);
+        t.data = strtoul (end + 1, &end, 0);
+        if (*end != ',' || !end[1] || targets.size () == MAX_TARGETS)
+          syntax (argv[0]);
+        t.fname = end + 1;
+        targets.push_back (t);
+        break;
+      }
+      case 'S': lockstep = true; break;
+      case 'W':
+        if (!parse_watch_list (optarg, watch_list))
+          return error_out (1);
+        break;
+      case 'o': watch_fname = optarg; break;
+      case 'C': watch_count = strtoull (optarg, 0, 0); break;
+      case 'M': manifest_dir = optarg; break;
+      case 'V': verify = true; break;
+      case 'x': check_flags |= XPDI_CHECK_STOP_FIRST; break;
+      case 'R': check_flags |= XPDI_CHECK_REFLASH; break;
       case 'h': // fall through
       default: syntax (argv[0]); break;
     }
   }
 
-  if (!dump_mem && !fname && !chip_erase)
+  bool watch = !watch_list.empty ();
+  if (!dump_mem && !fname && !chip_erase && targets.empty () && !watch)
     syntax (argv[0]);
 
+  if (watch && (dump_mem || fname || chip_erase || station ||
+      !targets.empty () || dry_run))
+  {
+    set_errinfo ("-W can not be combined with -D, -F, -E, -L, -m or -n", -1);
+    return error_out (1);
+  }
+
+  if (manifest_dir && !fname && targets.empty ())
+  {
+    set_errinfo ("-M requires -F or -m", -1);
+    return error_out (1);
+  }
+
+  if (verify && ((!fname && targets.empty ()) || dump_mem || chip_erase ||
+      section_erase || station))
+  {
+    set_errinfo ("-V requires -F or -m, and no -D, -E, -e or -L", -1);
+    return error_out (1);
+  }
+
+  if (check_flags && !verify)
+  {
+    set_errinfo ("-x and -R require -V", -1);
+    return error_out (1);
+  }
+
+  if (!targets.empty () && (dump_mem || fname || station))
+  {
+    set_errinfo ("-m can not be combined with -D, -F or -L", -1);
+    return error_out (1);
+  }
+
+  if (lockstep && (targets.empty () || !can_lockstep (targets)))
+  {
+    set_errinfo ("-S needs -m targets with clock pins on gpio 0-31", -1);
+    return error_out (1);
+  }
+
+  if (lockstep && manifest_dir)
+  {
+    set_errinfo ("-S can not be combined with -M", -1);
+    return error_out (1);
+  }
+
+  // manifest file i/o would stall a lock-step group, and a thread sharing a
+  // core leaves its target unclocked; so every target needs a core of its
+  // own, besides core 0, which is where the keep-alive helpers run
+  if (manifest_dir && !targets.empty () &&
+      (long)targets.size () >= sysconf (_SC_NPROCESSORS_ONLN))
+  {
+    set_errinfo ("-M needs a spare core for each -m target", -1);
+    return error_out (1);
+  }
+
+  if (dry_run && (station || !targets.empty () || trace_fname))
+  {
+    set_errinfo ("dry run can not be combined with -L, -m or -t", -1);
+    return error_out (1);
+  }
+
   if (dump_mem && (fname || chip_erase))
   {
     set_errinfo ("dumping not supported in conjunction with write/erase", -1);
     return error_out (1);
   }
 
+  if (station && (!fname || dump_mem))
+  {
+    set_errinfo ("station mode requires -F and no -D", -1);
+    return error_out (1);
+  }
+
+  if (station && chip_erase)
+  {
+    set_errinfo ("-E can not be combined with -L", -1);
+    return error_out (1);
+  }
+
+  if (serial_patch.enabled)
+  {
+    uint32_t limit = serial_patch.usersig ? NVM_USERSIG_SIZE : 0xffffffff;
+    uint32_t end = serial_patch.offs + serial_patch.len;
+    if (!station || serial_patch.len < 1 || serial_patch.len > 8 ||
+        end > limit ||
+        (!serial_patch.usersig && (serial_patch.offs / 512 != (end - 1) / 512)))
+    {
+      set_errinfo (
+        "serial patching needs -L and 1..8 bytes within a single page", -1);
+      return error_out (1);
+    }
+  }
+
+  page_list_t pages;
+  xpdi_image_t *image = 0;
+  static char serial_page[IMAGE_PAGE_SIZE];
   if (fname)
   {
-    std::ifstream in (fname);
-    if (!load_ihex (in, page_map))
-      return error_out (2);
+    if ((ret = xpdi_image_load (fname, &image)))
+      return error_out (ret);
+    if (!adopt_image_base (image, &flash_base, &base_set))
+      return error_out (1);
+    pages = xpdi_image_pages (image);
+  }
+
+  for (auto &t : targets)
+  {
+    if ((ret = xpdi_image_load (t.fname.c_str (), &t.img)))
+      return error_out (ret);
+    if (!adopt_image_base (t.img, &flash_base, &base_set))
+      return error_out (1);
+  }
+
+  flash_region_t region = plan_region (flash_base);
+
+  if (section_erase && !fname && targets.empty ())
+  {
+    set_errinfo ("section erase requires -F or -m", -1);
+    return error_out (1);
+  }
+
+  if (section_erase && fname && !region.size)
+  {
+    set_errinfo (
+      "section erase requires -F and a known section (default -a or -b)", -1);
+    return error_out (1);
   }
 
+  if (serial_patch.enabled && !serial_patch.usersig)
+    prepare_serial_page (pages, serial_patch, serial_page);
+
+  if (section_erase && !targets.empty () && !region.size)
+  {
+    set_errinfo ("section erase requires a known section", -1);
+    return error_out (1);
+  }
+
+  for (auto &t : targets)
+  {
+    t.chip_erase = chip_erase;
+    t.verify = verify;
+    t.check_flags = check_flags;
+    t.plan = plan_programming (xpdi_image_pages (t.img), region, chip_erase,
+      section_erase, pdi_delay_us);
+  }
+
+  plan_t plan = plan_programming (
+    pages, region, chip_erase, section_erase, pdi_delay_us);
+
   if (!quiet)
   {
     const char *hint = "unknown";
@@ -174,86 +852,216 @@ int main (int argc, char *argv[])
       printf ("dump-memory ");
     if (chip_erase)
       printf ("chip-erase ");
+    const char *action = verify ? "verify" : "program";
     if (fname)
-      printf ("program:%s ", fname);
+      printf ("%s:%s ", action, fname);
+    for (auto &t : targets)
+      printf ("%s:%s@gpio%d,%d ", action, t.fname.c_str (), t.clk, t.data);
+    if (station)
+      printf ("station ");
+    if (watch)
+      printf ("watch ");
     printf ("\n");
+    if (fname && !verify)
+    {
+      printf ("Plan: %s, %u pages to write, %u blank, est. %.2fs",
+        plan_name (plan.kind), plan.write_pages, plan.blank_pages,
+        plan.est_us / 1e6);
+      if (plan.blank_check)
+        printf (" (%.2fs if blank check passes)", plan.est_blank_us / 1e6);
+      printf ("\n");
+    }
   }
 
-  // Okay, all the slow stuff is done, now we're entering PDI programming mode
+  xpdi_config_t cfg;
+  xpdi_default_config (&cfg);
+  cfg.clk_pin = clk_pin;
+  cfg.data_pin = data_pin;
+  cfg.delay_us = pdi_delay_us;
+  cfg.flash_base = flash_base;
+  cfg.dry_run = dry_run;
+  cfg.run_target = watch;
+  cfg.telemetry_shm = tm_name;
+  cfg.trace_records = trace_fname ? TRACE_RECORDS : 0;
+  cfg.manifest_dir = manifest_dir;
 
-  if (!pdi_init (clk_pin, data_pin, pdi_delay_us))
-    return error_out (3);
+  if (!targets.empty ())
+  {
+    // each target gets its own session, telemetry block and trace
+    for (size_t i = 0; i < targets.size (); ++i)
+    {
+      target_t &t = targets[i];
+      std::string tm_target = std::string (tm_name ? tm_name : "") + "." +
+        std::to_string (i);
+      xpdi_config_t tcfg = cfg;
+      tcfg.clk_pin = t.clk;
+      tcfg.data_pin = t.data;
+      tcfg.telemetry_shm = tm_name ? tm_target.c_str () : 0;
+      if ((ret = xpdi_new (&tcfg, &t.s)))
+        return error_out (ret);
+      contexts[i] = xpdi_ctx (t.s);
+    }
 
-  // from here on we need to bail_out(n) instead of error_out, so we pdi_close()
-  if (!pdi_open () || !nvm_wait_enabled ())
-    bail_out (4);
+    ret = run_targets (targets, lockstep);
 
-  if (dump_mem)
-  {
-    uint32_t keep_addr = dump_addr;
-    uint32_t keep_len = dump_len;
-    while (dump_len)
+    for (size_t i = 0; i < targets.size (); ++i)
     {
-      uint16_t offs = dump_addr % 512;
-      uint16_t len = (dump_len > 512) ? 512 : dump_len;
-      uint32_t pgaddr = dump_addr - offs;
-      auto &pg = page_map[pgaddr];
-      pg.addr = pgaddr;
-      if (!nvm_read (flash_base + pgaddr, pg.data, 512))
-        bail_out (10);
+      std::string trace_name =
+        std::string (trace_fname ? trace_fname : "") + "." + std::to_string (i);
+      if (trace_fname &&
+          !pdi_trace_save (xpdi_ctx (targets[i].s), trace_name.c_str ()))
+        fprintf (stderr, "warning: failed to write trace to %s\n",
+          trace_name.c_str ());
+      contexts[i] = 0;
+      xpdi_free (targets[i].s);
+      xpdi_image_free (targets[i].img);
+    }
+    if (!ret)
+      printf ("ok\n");
+    return ret;
+  }
 
-      dump_len -= len;
-      dump_addr += len;
+  watch_plan_t wplan = plan_watch (watch_list);
+  watch_result_t wres = { 0, 0 };
+  FILE *watch_out = 0;
+  if (watch)
+  {
+    watch_out = watch_fname ? fopen (watch_fname, "wb") : stdout;
+    if (!watch_out)
+    {
+      set_errinfo ("failed to open watch output file", -1);
+      return error_out (8);
     }
-    dump_addr = keep_addr;
-    dump_len = keep_len;
+    if (!quiet)
+      printf ("Watch: %zu locations in %zu bursts, %u bytes per sample\n",
+        wplan.entries.size (), wplan.bursts.size (), wplan.burst_bytes);
+  }
+
+  xpdi_session_t *s;
+  if ((ret = xpdi_new (&cfg, &s)))
+    return error_out (ret);
+  pdi_ctx_t *ctx = xpdi_ctx (s);
+  telemetry_t *tm = pdi_telemetry (ctx);
+  contexts[0] = ctx;
+
+  // Okay, all the slow stuff is done, now we're entering PDI programming mode
+
+  if (station)
+  {
+    ret = run_station (s, pages, plan, serial_patch, serial_page, quiet);
+    if (trace_fname && !pdi_trace_save (ctx, trace_fname))
+      fprintf (stderr, "warning: failed to write trace to %s\n", trace_fname);
+    contexts[0] = 0;
+    xpdi_free (s);
+    xpdi_image_free (image);
+    return ret;
   }
 
-  if (chip_erase)
+  bool blank = false;
+  xpdi_check_t check;
+  memset (&check, 0, sizeof (check));
+
+  // from here on we need to bail_out(n) instead of error_out, so we close
+  int err = xpdi_open (s);
+  if (err)
+    bail_out (err);
+
+  if (watch)
   {
-    if (!nvm_chip_erase ())
+    telemetry_set_phase (tm, TM_READ);
+    if (!run_watch (ctx, wplan, watch_out, watch_fname != 0, watch_count,
+        &stopping, &wres))
     {
-      set_errinfo ("failed to perform chip erase", -1);
-      bail_out (11);
+      xpdi_fail (s);
+      bail_out (17);
     }
   }
 
-  if (fname)
+  if (dump_mem)
   {
-    for (auto &i : page_map)
+    // read a page at a time, and print each while the keep-alive holds the
+    // link; without a spare core, everything is printed after closing
+    uint32_t npages = (dump_addr % 512 + dump_len + 511) / 512;
+    uint32_t at = dump_addr;
+    uint32_t left = dump_len;
+    for (uint32_t n = 0; left; ++n)
     {
-      auto &p = i.second;
-      if (!nvm_rewrite_page (flash_base + p.addr, p.data, sizeof (p.data)))
+      uint16_t offs = at % 512;
+      uint16_t len = (left > 512u - offs) ? 512 - offs : left;
+      uint32_t pgaddr = at - offs;
+      auto &pg = page_map[pgaddr];
+      pg.addr = pgaddr;
+      telemetry_set_page (tm, n, npages);
+      if ((err = xpdi_read (s, at, pg.data + offs, len)))
+        bail_out (err);
+
+      if (!dry_run && pdi_keepalive_begin (ctx))
       {
-        set_errinfo ("failed to rewrite page at address", p.addr);
-        bail_out (12);
+        dump (at, pg.data + offs, len);
+        fflush (stdout);
+        pdi_keepalive_end (ctx);
+        page_map.erase (pgaddr);
       }
+
+      left -= len;
+      at += len;
     }
   }
 
+  if (chip_erase && (err = xpdi_chip_erase (s)))
+    bail_out (err);
+
+  if (fname && verify && (err = xpdi_check (s, pages, check_flags, &check)))
+    bail_out (err);
+  else if (fname && !verify && (err = xpdi_program (s, pages, plan, &blank)))
+    bail_out (err);
+
 out:
-  pdi_close ();
+  err = xpdi_close (s);
+  if (!ret)
+    ret = err;
+
+  if (trace_fname && !pdi_trace_save (ctx, trace_fname))
+    fprintf (stderr, "warning: failed to write trace to %s\n", trace_fname);
 
   // ...and we're back to being allowed to go a bit slower *phew*
 
-  if (!ret && dump_mem)
+  if (watch_out && watch_out != stdout)
+    fclose (watch_out);
+
+  if (!ret && watch && !quiet)
+  {
+    // stdout may well be carrying the samples
+    fprintf (watch_fname ? stdout : stderr,
+      "Watch: %llu samples in %.2fs, %.0f samples/s\n",
+      (unsigned long long)wres.samples, wres.secs,
+      wres.secs > 0 ? (wres.samples - 1) / wres.secs : 0.0);
+  }
+
+  if (!ret && dry_run)
+    print_estimate (ctx, pdi_delay_us);
+  else if (!ret && dump_mem)
   {
-    uint16_t start_offs = dump_addr % 512;
-    uint16_t end_offs = (dump_addr + dump_len) % 512;
-    auto p = page_map.begin ();
-    for (size_t i = 0; i < page_map.size (); ++i, ++p)
+    // whatever couldn't be printed on the fly
+    uint32_t end = dump_addr + dump_len;
+    for (auto &p : page_map)
     {
-      uint16_t offs = 0;
-      uint16_t end = 512;
-      if (i == 0)
-        offs = start_offs;
-      if (i == (page_map.size () -1))
-        end = end_offs;
-
-      dump (p->first + offs, p->second.data + offs, end - offs);
+      uint32_t from = (p.first > dump_addr) ? p.first : dump_addr;
+      uint32_t to = (p.first + 512 < end) ? p.first + 512 : end;
+      dump (from, p.second.data + from - p.first, to - from);
     }
   }
 
+  if (verify && !dry_run && (!ret || ret == XPDI_ERR_VERIFY))
+    print_check (check);
+
+  if (!ret && !quiet)
+    print_manifest (s);
+
+  if (!ret && !quiet && plan.blank_check)
+    printf ("Blank check: %s\n",
+      blank ? "section blank, programmed write-only" : "section not blank");
+
   if (ret)
     return error_out (ret);
   else
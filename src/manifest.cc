@@ -0,0 +1,133 @@
+/* Copyright (C) 2015 DiUS Computing Pty. Ltd.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#include "manifest.h"
+#include "errinfo.h"
+#include <algorithm>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+
+static bool manifest_path (
+  char *path, const char *dir, const char *id, const char *ext)
+{
+  int n = snprintf (path, PATH_MAX, "%s/%s.manifest%s", dir, id, ext);
+  return n > 0 && n < PATH_MAX;
+}
+
+
+static bool by_addr (const image_page_t &p, uint32_t addr)
+{
+  return p.addr < addr;
+}
+
+
+void manifest_device_id (const char *prodsig_id, char *id)
+{
+  // skip the reserved bytes at 6, 7 and 9
+  const uint8_t *p = (const uint8_t *)prodsig_id;
+  snprintf (id, MANIFEST_ID_LEN + 1,
+    "%02x%02x%02x%02x%02x%02x-%02x-%02x%02x-%02x%02x",
+    p[0], p[1], p[2], p[3], p[4], p[5], p[8], p[11], p[10], p[13], p[12]);
+}
+
+
+void manifest_reserve (manifest_t &m, size_t pages)
+{
+  m.id.reserve (MANIFEST_ID_LEN);
+  m.pages.reserve (pages);
+}
+
+
+void load_manifest (const char *dir, const char *id, manifest_t &m)
+{
+  m.id.assign (id);
+  m.pages.clear ();
+  m.dirty = false;
+
+  char path[PATH_MAX];
+  FILE *f = manifest_path (path, dir, id, "") ? fopen (path, "r") : 0;
+  if (!f)
+    return;
+  char magic[16], fid[MANIFEST_ID_LEN + 1];
+  unsigned version;
+  bool ok = fscanf (f, "%15s %u %25s", magic, &version, fid) == 3 &&
+    strcmp (magic, MANIFEST_MAGIC) == 0 && version == MANIFEST_VERSION &&
+    strcmp (id, fid) == 0;
+  image_page_t p;
+  unsigned long long hash;
+  while (ok && fscanf (f, "%x %x %llx", &p.addr, &p.crc, &hash) == 3)
+  {
+    p.hash = hash;
+    if (!m.pages.empty () && p.addr <= m.pages.back ().addr)
+      ok = false;
+    else
+      m.pages.push_back (p);
+  }
+  if (!ok || !feof (f))
+    m.pages.clear ();
+  fclose (f);
+}
+
+
+bool save_manifest (const char *dir, const manifest_t &m)
+{
+  // written aside and renamed over, so a crash never leaves half a manifest
+  char path[PATH_MAX], tmp[PATH_MAX];
+  FILE *f = manifest_path (path, dir, m.id.c_str (), "") &&
+    manifest_path (tmp, dir, m.id.c_str (), ".tmp") ? fopen (tmp, "w") : 0;
+  if (!f)
+    return_errinfo (false, "failed to write device manifest");
+  bool ok =
+    fprintf (f, "%s %u %s\n", MANIFEST_MAGIC, MANIFEST_VERSION,
+      m.id.c_str ()) > 0;
+  for (auto &p : m.pages)
+    ok = ok && fprintf (f, "%08x %08x %016llx\n",
+      p.addr, p.crc, (unsigned long long)p.hash) > 0;
+  ok = (fclose (f) == 0) && ok;
+  if (!ok || rename (tmp, path) != 0)
+  {
+    remove (tmp);
+    return_errinfo (false, "failed to write device manifest");
+  }
+  return true;
+}
+
+
+const image_page_t *manifest_find (const manifest_t &m, uint32_t addr)
+{
+  auto i = std::lower_bound (m.pages.begin (), m.pages.end (), addr, by_addr);
+  return (i != m.pages.end () && i->addr == addr) ? &*i : 0;
+}
+
+
+void manifest_record (manifest_t &m, uint32_t addr, const page_ref_t &ref)
+{
+  image_page_t p;
+  p.addr = addr;
+  p.crc = ref.entry ? ref.entry->crc : page_crc (ref.data, IMAGE_PAGE_SIZE);
+  p.hash = ref.entry ? ref.entry->hash : page_hash (ref.data, IMAGE_PAGE_SIZE);
+  auto i = std::lower_bound (m.pages.begin (), m.pages.end (), addr, by_addr);
+  if (i != m.pages.end () && i->addr == addr)
+    *i = p;
+  else
+    m.pages.insert (i, p);
+  m.dirty = true;
+}
+
+
+void manifest_forget (manifest_t &m, uint32_t from, uint32_t to)
+{
+  auto a = std::lower_bound (m.pages.begin (), m.pages.end (), from, by_addr);
+  auto b = std::lower_bound (a, m.pages.end (), to, by_addr);
+  if (a == b)
+    return;
+  m.pages.erase (a, b);
+  m.dirty = true;
+}
@@ -0,0 +1,53 @@
+/* Copyright (C) 2015 DiUS Computing Pty. Ltd.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#ifndef _MANIFEST_H_
+#define _MANIFEST_H_
+
+#include "image.h"
+#include <string>
+
+// What was last written to a particular device, page by page, as verified
+// by reading it back. Kept in a directory with a file per device, named
+// after the device id: a "PDIMANIFEST 1" line, the id, then a line per page
+// with its PDI address, CRC-32 and hash, all in hex.
+#define MANIFEST_MAGIC   "PDIMANIFEST"
+#define MANIFEST_VERSION 1
+
+// lot number, wafer number, x and y: "LLLLLLLLLLLL-WW-XXXX-YYYY"
+#define MANIFEST_ID_LEN  25
+
+struct manifest_t
+{
+  std::string id;
+  std::vector<image_page_t> pages; // by address; addr is a PDI address
+  bool dirty;
+};
+
+// formats the id part of the production signature row (see nvm.h) into
+// MANIFEST_ID_LEN + 1 bytes at id
+void manifest_device_id (const char *prodsig_id, char *id);
+
+// makes room for this many pages, so that loading and recording up to that
+// many doesn't allocate
+void manifest_reserve (manifest_t &m, size_t pages);
+
+// a missing or unreadable manifest loads as empty: it only ever saves work
+void load_manifest (const char *dir, const char *id, manifest_t &m);
+
+bool save_manifest (const char *dir, const manifest_t &m);
+
+const image_page_t *manifest_find (const manifest_t &m, uint32_t addr);
+
+// records the page's data as now known to be at addr (a PDI address)
+void manifest_record (manifest_t &m, uint32_t addr, const page_ref_t &p);
+
+// drops whatever is recorded for the pages in [from, to)
+void manifest_forget (manifest_t &m, uint32_t from, uint32_t to);
+
+#endif
@@ -8,6 +8,7 @@
 
 #include "nvm.h"
 #include "pdi.h"
+#include "telemetry.h"
 
 #define PAGE_SIZE 512
 #define WAIT_ATTEMPTS 2000
@@ -24,6 +25,7 @@ enum {
   NVM_WRITE_FLASH_PAGE              = 0x2E, // pdi write
   NVM_ERASE_WRITE_FLASH_PAGE        = 0x2F, // pdi write
   NVM_FLASH_CRC                     = 0x78, // cmdex
+  NVM_FLASH_RANGE_CRC               = 0x3A, // cmdex, AU/A3U parts
 
   NVM_ERASE_APP_SECTION             = 0x20, // pdi write
   NVM_ERASE_APP_SECTION_PAGE        = 0x22, // pdi write
@@ -57,6 +59,8 @@ enum {
 };
 
 #define NVM_REG_BASE    0x010001C0
+#define NVM_REG_ADDR_OFFS     0x00
+#define NVM_REG_DATA_OFFS     0x04
 #define NVM_REG_CMD_OFFS      0x0A
 #define NVM_REG_CTRLA_OFFS    0x0B
 #define NVM_REG_STATUS_OFFS   0x0F
@@ -67,11 +71,42 @@ enum {
 
 #define PDI_NVMEN_bm 0x02
 
+#define NVM_STATUS_ADDR (NVM_REG_BASE + NVM_REG_STATUS_OFFS)
+
 
 
 // --- Helper functions --------------------------------------------
 
-static inline bool nvm_cmdex (void)
+// Register writes and pointer loads are elided where the shadow (see
+// pdi_shadow_t) says the target already holds the value; the shadow is
+// only updated once the bytes have made it across.
+
+// puts an ST PTR addr into cmds, unless the pointer is known to be there
+// already; returns the number of bytes used
+static uint8_t nvm_ptr_cmds (pdi_ctx_t *ctx, uint32_t addr, char *cmds)
+{
+  pdi_shadow_t *sh = pdi_shadow (ctx);
+  if (sh->ptr_valid && sh->ptr == addr)
+    return 0;
+
+  cmds[0] = ST | PTR | SZ_4;
+  cmds[1] = (addr      ) & 0xff;
+  cmds[2] = (addr >>  8) & 0xff;
+  cmds[3] = (addr >> 16) & 0xff;
+  cmds[4] = (addr >> 24) & 0xff;
+  return 5;
+}
+
+
+static inline void nvm_ptr_moved (pdi_ctx_t *ctx, uint32_t addr)
+{
+  pdi_shadow_t *sh = pdi_shadow (ctx);
+  sh->ptr_valid = true;
+  sh->ptr = addr;
+}
+
+
+static inline bool nvm_cmdex (pdi_ctx_t *ctx)
 {
   static const char cmds[] = {
     STS | (SZ_4 << 2) | SZ_1,
@@ -81,12 +116,23 @@ static inline bool nvm_cmdex (void)
     ((NVM_REG_BASE + NVM_REG_CTRLA_OFFS) >> 24) & 0xff,
     NVM_CTRLA_CMDEX_bm
   };
-  return pdi_send (cmds, sizeof (cmds));
+  if (!pdi_send (ctx, cmds, sizeof (cmds)))
+    return false;
+
+  // some commands clear CMD once done, so don't count on it afterwards
+  pdi_shadow_t *sh = pdi_shadow (ctx);
+  sh->nvm_cmd_valid = false;
+  sh->nvm_idle = false;
+  return true;
 }
 
 
-static inline bool nvm_loadcmd (uint8_t cmd)
+static inline bool nvm_loadcmd (pdi_ctx_t *ctx, uint8_t cmd)
 {
+  pdi_shadow_t *sh = pdi_shadow (ctx);
+  if (sh->nvm_cmd_valid && sh->nvm_cmd == cmd)
+    return true;
+
   char cmds[] = {
     STS | (SZ_4 << 2) | SZ_1,
     ((NVM_REG_BASE + NVM_REG_CMD_OFFS)      ) & 0xff,
@@ -95,41 +141,132 @@ static inline bool nvm_loadcmd (uint8_t cmd)
     ((NVM_REG_BASE + NVM_REG_CMD_OFFS) >> 24) & 0xff,
     cmd
   };
-  return pdi_send (cmds, sizeof (cmds));
+  if (!pdi_send (ctx, cmds, sizeof (cmds)))
+    return false;
+
+  sh->nvm_cmd_valid = true;
+  sh->nvm_cmd = cmd;
+  return true;
 }
 
 
-static inline bool nvm_controller_busy_wait (void)
+static inline bool nvm_controller_busy_wait (pdi_ctx_t *ctx)
 {
-  static const char cmds[] = {
-    ST | PTR | SZ_4,
-    ((NVM_REG_BASE + NVM_REG_STATUS_OFFS)      ) & 0xff,
-    ((NVM_REG_BASE + NVM_REG_STATUS_OFFS) >>  8) & 0xff,
-    ((NVM_REG_BASE + NVM_REG_STATUS_OFFS) >> 16) & 0xff,
-    ((NVM_REG_BASE + NVM_REG_STATUS_OFFS) >> 24) & 0xff
-  };
+  pdi_shadow_t *sh = pdi_shadow (ctx);
+  if (sh->nvm_idle)
+    return true; // nothing kicked off since the last wait
 
-  if (!pdi_send (cmds, sizeof (cmds)))
-    return false;
+  // the pointer load, if any, goes out with the first poll
+  char cmds[6];
+  uint8_t len = nvm_ptr_cmds (ctx, NVM_STATUS_ADDR, cmds);
+  cmds[len++] = LD | xPTR | SZ_1;
 
-  const char status_cmd = LD | xPTR | SZ_1;
+  const char *status_cmd = cmds;
   char status = 0;
   int max_attempts = WAIT_ATTEMPTS;
   do
   {
-    if (!pdi_sendrecv (&status_cmd, 1, &status, 1))
+    if (!pdi_sendrecv (ctx, status_cmd, len, &status, 1))
       return false;
+    nvm_ptr_moved (ctx, NVM_STATUS_ADDR);
+    status_cmd += len - 1; // just the LD from now on
+    len = 1;
     if (--max_attempts == 0)
       return false;
+    if (status & NVM_STATUS_BUSY_bm)
+      telemetry_add_retry (pdi_telemetry (ctx));
   } while (status & NVM_STATUS_BUSY_bm);
 
+  sh->nvm_idle = true;
   return true;
 }
 
 
+// what a dry run should charge for the controller working on cmd
+static uint32_t nvm_busy_us (uint8_t cmd)
+{
+  switch (cmd)
+  {
+    case NVM_ERASE_FLASH_PAGE:
+    case NVM_ERASE_APP_SECTION_PAGE:
+    case NVM_ERASE_BOOT_SECTION_PAGE:       return NVM_PAGE_ERASE_US;
+    case NVM_WRITE_FLASH_PAGE:
+    case NVM_WRITE_APP_SECTION_PAGE:
+    case NVM_WRITE_BOOT_SECTION_PAGE:
+    case NVM_WRITE_USERSIG_ROW:             return NVM_PAGE_WRITE_US;
+    case NVM_ERASE_WRITE_FLASH_PAGE:
+    case NVM_ERASE_WRITE_APP_SECTION_PAGE:
+    case NVM_ERASE_WRITE_BOOT_SECTION_PAGE: return NVM_PAGE_ERASE_WRITE_US;
+    case NVM_ERASE_APP_SECTION:
+    case NVM_ERASE_BOOT_SECTION:            return NVM_SECTION_ERASE_US;
+    case NVM_ERASE_USERSIG_ROW:             return NVM_USERSIG_ERASE_US;
+    case NVM_CHIP_ERASE:                    return NVM_CHIP_ERASE_US;
+    case NVM_APP_SECTION_CRC:
+      return NVM_APP_SECTION_SIZE / NVM_CRC_BYTES_PER_US;
+    case NVM_BOOT_SECTION_CRC:
+      return NVM_BOOT_SECTION_SIZE / NVM_CRC_BYTES_PER_US;
+    default:                                return 0;
+  }
+}
+
+
+// sends a dummy write to addr, which makes the NVM controller perform the
+// pdi-write triggered command cmd on the page/section containing addr
+static bool nvm_trigger (pdi_ctx_t *ctx, uint8_t cmd, uint32_t addr)
+{
+  char page_cmds[7];
+  uint8_t len = nvm_ptr_cmds (ctx, addr, page_cmds);
+  page_cmds[len++] = ST | xPTRpp | SZ_1; // dummy write to trigger the command
+  page_cmds[len++] = 0;
+
+  if (!nvm_loadcmd (ctx, cmd) ||
+      !pdi_send (ctx, page_cmds, len))
+    return false;
+
+  nvm_ptr_moved (ctx, addr + 1);
+  pdi_shadow (ctx)->nvm_idle = false;
+  pdi_model_busy (ctx, nvm_busy_us (cmd));
+  return nvm_controller_busy_wait (ctx);
+}
+
+
+// fills the page buffer, then commits it using the pdi-write command cmd
+static bool nvm_program_page (
+  pdi_ctx_t *ctx, uint8_t cmd, uint32_t addr, const char *buf, uint16_t len)
+{
+  if (len > PAGE_SIZE)
+    return false;
+
+  if (!nvm_controller_busy_wait (ctx) ||
+      !nvm_loadcmd (ctx, NVM_ERASE_PAGE_BUF) ||
+      !nvm_cmdex (ctx))
+    return false;
+
+  if (!nvm_controller_busy_wait (ctx) ||
+      !nvm_loadcmd (ctx, NVM_LOAD_PAGE_BUF))
+    return false;
+
+  // I would guess only the lower PAGE_SIZE part of the address is relevant
+  // while writing to the page buffer, but the application note is very unclear
+  uint16_t rpt = len -1;
+  char buf_cmds[9];
+  uint8_t n = nvm_ptr_cmds (ctx, addr, buf_cmds);
+  buf_cmds[n++] = REPEAT | SZ_2;
+  buf_cmds[n++] = (rpt     ) & 0xff;
+  buf_cmds[n++] = (rpt >> 8) & 0xff;
+  buf_cmds[n++] = ST | xPTRpp | SZ_1;
+  if (!pdi_send (ctx, buf_cmds, n) ||
+      !pdi_send (ctx, buf, len))
+    return false;
+
+  nvm_ptr_moved (ctx, addr + len);
+  return nvm_trigger (ctx, cmd, addr);
+}
+
+
 // --- API functions -----------------------------------------------
 
-bool nvm_wait_enabled (void)
+bool nvm_wait_enabled (pdi_ctx_t *ctx)
 {
   const char read_status = LDCS | PDI_REG_STATUS;
   char status = 0x00;
@@ -138,95 +275,164 @@ bool nvm_wait_enabled (void)
   {
     if (--max_attempts == 0)
       return false;
-    if (!pdi_sendrecv (&read_status, 1, &status, 1))
+    if (!pdi_sendrecv (ctx, &read_status, 1, &status, 1))
       return false;
+    if (!(status & PDI_NVMEN_bm))
+      telemetry_add_retry (pdi_telemetry (ctx));
   }
   return true;
 }
 
 
-bool nvm_read (uint32_t addr, char *buf, uint32_t len)
+bool nvm_read (pdi_ctx_t *ctx, uint32_t addr, char *buf, uint32_t len)
 {
+  // back-to-back reads leave the pointer where the next one starts, and
+  // the controller idle, so those only cost the REPEAT and LD
+  if (!nvm_controller_busy_wait (ctx) ||
+      !nvm_loadcmd (ctx, NVM_READ))
+    return false;
+
   uint32_t rpt = len -1;
-  char cmds[] = {
-    ST | PTR | SZ_4,
-    (addr      ) & 0xff,
-    (addr >>  8) & 0xff,
-    (addr >> 16) & 0xff,
-    (addr >> 24) & 0xff,
-
-    REPEAT | SZ_4,
-    (rpt      ) & 0xff,
-    (rpt >>  8) & 0xff,
-    (rpt >> 16) & 0xff,
-    (rpt >> 24) & 0xff,
-
-    LD | xPTRpp | SZ_1
-  };
+  char cmds[11];
+  uint8_t n = nvm_ptr_cmds (ctx, addr, cmds);
+  cmds[n++] = REPEAT | SZ_4;
+  cmds[n++] = (rpt      ) & 0xff;
+  cmds[n++] = (rpt >>  8) & 0xff;
+  cmds[n++] = (rpt >> 16) & 0xff;
+  cmds[n++] = (rpt >> 24) & 0xff;
+  cmds[n++] = LD | xPTRpp | SZ_1;
+
+  if (!pdi_sendrecv (ctx, cmds, n, buf, len))
+    return false;
+
+  nvm_ptr_moved (ctx, addr + len);
+  return true;
+}
+
+
+bool nvm_rewrite_page (
+  pdi_ctx_t *ctx, uint32_t addr, const char *buf, uint16_t len)
+{
+  return nvm_program_page (ctx, NVM_ERASE_WRITE_FLASH_PAGE, addr, buf, len);
+}
+
+
+bool nvm_write_page (
+  pdi_ctx_t *ctx, uint32_t addr, const char *buf, uint16_t len)
+{
+  return nvm_program_page (ctx, NVM_WRITE_FLASH_PAGE, addr, buf, len);
+}
+
 
+bool nvm_erase_page (pdi_ctx_t *ctx, uint32_t addr)
+{
   return
-    nvm_controller_busy_wait () &&
-    nvm_loadcmd (NVM_READ) &&
-    pdi_sendrecv (cmds, sizeof (cmds), buf, len);
+    nvm_controller_busy_wait (ctx) &&
+    nvm_trigger (ctx, NVM_ERASE_FLASH_PAGE, addr);
 }
 
 
-bool nvm_rewrite_page (uint32_t addr, const char *buf, uint16_t len)
+bool nvm_erase_section (pdi_ctx_t *ctx, uint32_t addr, bool boot)
 {
-  if (len > PAGE_SIZE)
+  return
+    nvm_controller_busy_wait (ctx) &&
+    nvm_trigger (
+      ctx, boot ? NVM_ERASE_BOOT_SECTION : NVM_ERASE_APP_SECTION, addr);
+}
+
+
+bool nvm_rewrite_usersig (pdi_ctx_t *ctx, const char *buf, uint16_t len)
+{
+  return
+    nvm_controller_busy_wait (ctx) &&
+    nvm_trigger (ctx, NVM_ERASE_USERSIG_ROW, NVM_USERSIG_ADDR) &&
+    nvm_program_page (
+      ctx, NVM_WRITE_USERSIG_ROW, NVM_USERSIG_ADDR, buf, len);
+}
+
+
+// fetches the result of a CRC command from DATA0..2
+static bool nvm_read_crc (pdi_ctx_t *ctx, uint32_t *crc)
+{
+  char data[3];
+  char cmds[8];
+  uint8_t n = nvm_ptr_cmds (ctx, NVM_REG_BASE + NVM_REG_DATA_OFFS, cmds);
+  cmds[n++] = REPEAT | SZ_1;
+  cmds[n++] = 2;
+  cmds[n++] = LD | xPTRpp | SZ_1;
+  if (!pdi_sendrecv (ctx, cmds, n, data, sizeof (data)))
     return false;
+  nvm_ptr_moved (ctx, NVM_REG_BASE + NVM_REG_DATA_OFFS + sizeof (data));
 
-  if (!nvm_controller_busy_wait () ||
-      !nvm_loadcmd (NVM_ERASE_PAGE_BUF) ||
-      !nvm_cmdex ())
+  *crc =
+    ((uint32_t)(uint8_t)data[0]      ) |
+    ((uint32_t)(uint8_t)data[1] <<  8) |
+    ((uint32_t)(uint8_t)data[2] << 16);
+  return true;
+}
+
+
+bool nvm_section_crc (pdi_ctx_t *ctx, bool boot, uint32_t *crc)
+{
+  uint8_t cmd = boot ? NVM_BOOT_SECTION_CRC : NVM_APP_SECTION_CRC;
+  if (!nvm_controller_busy_wait (ctx) ||
+      !nvm_loadcmd (ctx, cmd) ||
+      !nvm_cmdex (ctx))
     return false;
 
-  if (!nvm_controller_busy_wait () ||
-      !nvm_loadcmd (NVM_LOAD_PAGE_BUF))
+  pdi_model_busy (ctx, nvm_busy_us (cmd));
+  return
+    nvm_controller_busy_wait (ctx) &&
+    nvm_read_crc (ctx, crc);
+}
+
+
+bool nvm_range_crc (pdi_ctx_t *ctx, uint32_t first, uint32_t last,
+  uint32_t *crc)
+{
+  if (!nvm_controller_busy_wait (ctx))
     return false;
 
-  // I would guess only the lower PAGE_SIZE part of the address is relevant
-  // while writing to the page buffer, but the application note is very unclear
-  uint16_t rpt = len -1;
-  char buf_cmds[] = {
-    ST | PTR | SZ_4,
-    (addr      ) & 0xff,
-    (addr >>  8) & 0xff,
-    (addr >> 16) & 0xff,
-    (addr >> 24) & 0xff,
-
-    REPEAT | SZ_2,
-    (rpt     ) & 0xff,
-    (rpt >> 8) & 0xff,
-
-    ST | xPTRpp | SZ_1
-  };
-  if (!pdi_send (buf_cmds, sizeof (buf_cmds)) || !pdi_send (buf, len))
+  // ADDR0..2 take the first byte, DATA0..2 the last, as flash addresses;
+  // the reserved register in between gets written as well, to keep it to
+  // a single burst
+  uint32_t from = first - NVM_FLASH_BASE, to = last - NVM_FLASH_BASE;
+  char cmds[15];
+  uint8_t n = nvm_ptr_cmds (ctx, NVM_REG_BASE + NVM_REG_ADDR_OFFS, cmds);
+  cmds[n++] = REPEAT | SZ_1;
+  cmds[n++] = 6;
+  cmds[n++] = ST | xPTRpp | SZ_1;
+  cmds[n++] = (from      ) & 0xff;
+  cmds[n++] = (from >>  8) & 0xff;
+  cmds[n++] = (from >> 16) & 0xff;
+  cmds[n++] = 0;
+  cmds[n++] = (to      ) & 0xff;
+  cmds[n++] = (to >>  8) & 0xff;
+  cmds[n++] = (to >> 16) & 0xff;
+  if (!pdi_send (ctx, cmds, n))
     return false;
+  nvm_ptr_moved (ctx, NVM_REG_BASE + NVM_REG_ADDR_OFFS + 7);
 
-  char page_cmds[] = {
-    ST | PTR | SZ_4,
-    (addr      ) & 0xff,
-    (addr >>  8) & 0xff,
-    (addr >> 16) & 0xff,
-    (addr >> 24) & 0xff,
-    ST | xPTRpp | SZ_1, // dummy write to trigger erase+program from page buf
-    0
-  };
+  if (!nvm_loadcmd (ctx, NVM_FLASH_RANGE_CRC) ||
+      !nvm_cmdex (ctx))
+    return false;
 
+  pdi_model_busy (ctx, (to - from + 1) / NVM_CRC_BYTES_PER_US);
   return
-    nvm_loadcmd (NVM_ERASE_WRITE_FLASH_PAGE) &&
-    pdi_send (page_cmds, sizeof (page_cmds)) &&
-    nvm_controller_busy_wait ();
+    nvm_controller_busy_wait (ctx) &&
+    nvm_read_crc (ctx, crc);
 }
 
 
-bool nvm_chip_erase (void)
+bool nvm_chip_erase (pdi_ctx_t *ctx)
 {
+  if (!nvm_controller_busy_wait (ctx) ||
+      !nvm_loadcmd (ctx, NVM_CHIP_ERASE) ||
+      !nvm_cmdex (ctx))
+    return false;
+
+  pdi_model_busy (ctx, nvm_busy_us (NVM_CHIP_ERASE));
   return
-    nvm_controller_busy_wait () &&
-    nvm_loadcmd (NVM_CHIP_ERASE) &&
-    nvm_cmdex () &&
-    nvm_wait_enabled () &&
-    nvm_controller_busy_wait ();
+    nvm_wait_enabled (ctx) &&
+    nvm_controller_busy_wait (ctx);
 }
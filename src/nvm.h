@@ -11,10 +11,55 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include "pdi.h"
 
-bool nvm_wait_enabled (void);
-bool nvm_read (uint32_t addr, char *buf, uint32_t len);
-bool nvm_rewrite_page (uint32_t addr, const char *buf, uint16_t len);
-bool nvm_chip_erase (void);
+#define NVM_FLASH_BASE   0x00800000
+#define NVM_USERSIG_ADDR 0x008E0400
+#define NVM_USERSIG_SIZE 512
+
+// the part of the production signature row that identifies a part: lot
+// number (6 bytes), a reserved pair, wafer number, a reserved byte, then
+// the x and y wafer coordinates (2 bytes each)
+#define NVM_PRODSIG_ID_ADDR 0x008E0208
+#define NVM_PRODSIG_ID_SIZE 14
+
+// section sizes of the x256 parts
+#define NVM_APP_SECTION_SIZE  0x40000
+#define NVM_BOOT_SECTION_SIZE  0x2000
+
+// NVM timings, from the XMEGA A3 datasheet (typical values); used for
+// planning, and to model busy time in dry runs
+#define NVM_PAGE_ERASE_US          4000
+#define NVM_PAGE_WRITE_US          4000
+#define NVM_PAGE_ERASE_WRITE_US    8000
+#define NVM_CHIP_ERASE_US        105000
+#define NVM_SECTION_ERASE_US     105000 // only chip erase is given, assume alike
+#define NVM_USERSIG_ERASE_US       4000
+
+// the on-chip CRC runs off the 2MHz PDI-mode clock; assume a byte per us
+#define NVM_CRC_BYTES_PER_US          1
+
+bool nvm_wait_enabled (pdi_ctx_t *ctx);
+bool nvm_read (pdi_ctx_t *ctx, uint32_t addr, char *buf, uint32_t len);
+bool nvm_rewrite_page (
+  pdi_ctx_t *ctx, uint32_t addr, const char *buf, uint16_t len);
+bool nvm_chip_erase (pdi_ctx_t *ctx);
+
+// for programming already-erased flash; write_page does not erase first
+bool nvm_write_page (
+  pdi_ctx_t *ctx, uint32_t addr, const char *buf, uint16_t len);
+bool nvm_erase_page (pdi_ctx_t *ctx, uint32_t addr);
+bool nvm_erase_section (pdi_ctx_t *ctx, uint32_t addr, bool boot);
+
+// erases and rewrites the user signature row at NVM_USERSIG_ADDR
+bool nvm_rewrite_usersig (pdi_ctx_t *ctx, const char *buf, uint16_t len);
+
+// on-chip checksum of the application or boot section (24 bits, DATA0..2)
+bool nvm_section_crc (pdi_ctx_t *ctx, bool boot, uint32_t *crc);
+
+// on-chip checksum of the flash from first to last, inclusive (PDI
+// addresses); same CRC and 24 bit result as the section CRC
+bool nvm_range_crc (pdi_ctx_t *ctx, uint32_t first, uint32_t last,
+  uint32_t *crc);
 
 #endif
@@ -6,10 +6,20 @@
    (at your option) any later version.
 */
 
+#define _GNU_SOURCE // thread affinity
+
 #include "pdi.h"
+#include "pdi_trace.h"
+#include "telemetry.h"
+#include "errinfo.h"
+#include <pthread.h>
 #include <sched.h>
+#include <ucontext.h>
 #include <sys/mman.h>
 #include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
 #include <bcm2835.h>
 
 typedef struct
@@ -22,7 +32,7 @@ typedef struct
   } pos;
 } byte_xfer_t;
 
-static struct
+struct pdi_ctx
 {
   // pdi_run loop breaker
   volatile bool stop;
@@ -44,307 +54,1175 @@ static struct
   pdi_sequence_t *cur;
   uint32_t cur_offs;
   byte_xfer_t byte;
+  uint8_t byte_flags;
 
   uint64_t ticks;
 
   bool switch_dir;
-} pdi;
 
+  // bus trace capture, a ring buffer preallocated by pdi_trace_enable()
+  struct
+  {
+    pdi_trace_rec_t *buf;
+    uint32_t cap;
+    uint32_t head;
+    uint32_t total;
+    uint64_t t0;
+  } trace;
+
+  telemetry_t *tm;
+
+  // link statistics, per telemetry phase; st points at the current phase's
+  pdi_stats_t stats[PDI_STATS_PHASES];
+  pdi_stats_t *st;
+
+  // dry run: no gpio is touched, frames are only counted
+  bool dry_run;
+
+  // open without holding reset or enabling NVM access
+  bool run_target;
+
+  pdi_shadow_t shadow;
+
+  // keep-alive helper, clocking idle bits while the owner is busy elsewhere;
+  // the pins change hands through state, so only one side drives them
+  struct
+  {
+    volatile int state;
+    uint64_t clocks;
+  } ka;
+
+  // set while clocked as part of a lock-step group
+  struct pdi_lane *lane;
 
+  bool hlapi_result;
+};
 
-static void load_next_byte ()
+// idle clocks the target is assumed to take before answering, in dry runs;
+// matches the 2 idle bits guard time set up by pdi_open()
+#define DRY_RX_GUARD_CLOCKS 2
+
+// inbound transfers at least this long go through bulk_recv()
+#define BULK_RX_MIN_LEN 16
+
+enum {
+  KA_IDLE,
+  KA_STARTING, // owner clocks, helper on its way
+  KA_READY,    // helper waiting to take over
+  KA_RUNNING,  // helper clocks
+  KA_STOPPING, // helper finishing its last bit
+};
+
+
+// A link being clocked as part of a lock-step group (see pdi_group_run()).
+// The lane's function runs as a coroutine on the group's thread, and
+// whenever it needs the link it parks itself until the shared clock loop
+// has done the work.
+typedef struct pdi_lane
+{
+  pdi_ctx_t *ctx;
+  pdi_lane_fn_t fn;
+  void *arg;
+  ucontext_t uc;
+  void *stack;
+
+  bool done;
+  bool waiting;        // parked until its link work is done
+  bool active;         // its clock pin is driven along with the group's
+  unsigned blind;      // idle clocks still to give
+  uint64_t hold_until; // clock held low until then, while inactive
+
+  const char *err;     // the lane's errinfo, while switched out
+  int errloc;
+} pdi_lane_t;
+
+struct pdi_group
 {
-  pdi.ticks = 0; // things are progressing, don't time out just yet...
+  ucontext_t sched;
+  pdi_lane_t lanes[PDI_GROUP_MAX_LANES];
+  unsigned n;
+  pdi_lane_t *cur;
+};
 
-  // if in input mode, store last received byte
-  if (pdi.cur->xfer->dir == PDI_IN)
-    pdi.cur->xfer->buf[pdi.cur_offs] = pdi.byte.val;
+// the lanes run the NVM layer and everything above it, file i/o included
+#define LANE_STACK_SIZE (256*1024)
+
+static __thread pdi_group_t *running_group;
+
+static void lane_wait (pdi_ctx_t *ctx);
+
+
+// gpio function selects are read-modify-write on registers shared between
+// up to ten pins, so contexts running on different cores must not overlap
+static volatile int fsel_lock;
 
-  if (++pdi.cur_offs >= pdi.cur->xfer->len)
+static void gpio_fsel (uint8_t pin, uint8_t mode)
+{
+  while (__sync_lock_test_and_set (&fsel_lock, 1))
+    ;
+  bcm2835_gpio_fsel (pin, mode);
+  __sync_lock_release (&fsel_lock);
+}
+
+// memory locking is per process, so it's only released by the last close
+static volatile int open_count;
+
+// realtime scheduling is per thread, and a thread running a lock-step group
+// has several links open
+static __thread int thread_open_count;
+
+
+static void trace (pdi_ctx_t *ctx, uint8_t kind, uint8_t val, uint8_t flags)
+{
+  if (!ctx->trace.buf || ctx->dry_run)
+    return;
+
+  uint64_t now = bcm2835_st_read ();
+  if (!ctx->trace.total++)
+    ctx->trace.t0 = now;
+
+  pdi_trace_rec_t *rec = &ctx->trace.buf[ctx->trace.head];
+  rec->ts_us = (uint32_t)(now - ctx->trace.t0);
+  rec->kind = kind;
+  rec->val = val;
+  rec->flags = flags;
+  rec->reserved = 0;
+
+  if (++ctx->trace.head == ctx->trace.cap)
+    ctx->trace.head = 0;
+}
+
+
+
+// selects the stats bucket for whatever phase the caller is in
+static void select_stats (pdi_ctx_t *ctx)
+{
+  uint32_t phase = ctx->tm ? ctx->tm->phase : TM_IDLE;
+  ctx->st = &ctx->stats[phase < PDI_STATS_PHASES ? phase : TM_IDLE];
+}
+
+
+// moves on to the next byte, and the next transfer if this one is done
+static void next_byte (pdi_ctx_t *ctx)
+{
+  if (++ctx->cur_offs >= ctx->cur->xfer->len)
   {
-    bool old_dir = pdi.cur->xfer->dir;
+    bool old_dir = ctx->cur->xfer->dir;
 
-    pdi.cur = pdi.cur->next;
-    pdi.cur_offs = 0;
+    ctx->cur = ctx->cur->next;
+    ctx->cur_offs = 0;
 
-    if (pdi.cur && pdi.cur->xfer->dir != old_dir)
-      pdi.switch_dir = true;
+    if (ctx->cur && ctx->cur->xfer->dir != old_dir)
+      ctx->switch_dir = true;
   }
-  // reinit (also used if pdi.cur->xfer->dir == PDI_IN)
-  pdi.byte.pos = XF_ST;
-  if (pdi.cur && pdi.cur->xfer->dir == PDI_OUT)
-    pdi.byte.val = (uint8_t)pdi.cur->xfer->buf[pdi.cur_offs];
+  // reinit (also used if ctx->cur->xfer->dir == PDI_IN)
+  ctx->byte.pos = XF_ST;
+  ctx->byte_flags = 0;
+  if (ctx->cur && ctx->cur->xfer->dir == PDI_OUT)
+    ctx->byte.val = (uint8_t)ctx->cur->xfer->buf[ctx->cur_offs];
   else
-    pdi.byte.val = 0;
+    ctx->byte.val = 0;
 }
 
 
-// https://graphics.stanford.edu/~seander/bithacks.html#ParityParallel
-static bool parity (uint8_t v)
+static void load_next_byte (pdi_ctx_t *ctx)
 {
-  v ^= v >> 4;
-  v &= 0xf;
-  return (0x6996 >> v) & 1;
+  ctx->ticks = 0; // things are progressing, don't time out just yet...
+
+  // if in input mode, store last received byte
+  if (ctx->cur->xfer->dir == PDI_IN)
+  {
+    ctx->cur->xfer->buf[ctx->cur_offs] = ctx->byte.val;
+    ++ctx->st->frames_in;
+    trace (ctx, PDI_TRACE_RX, ctx->byte.val, ctx->byte_flags);
+  }
+  else
+  {
+    ++ctx->st->frames_out;
+    trace (ctx, PDI_TRACE_TX, ctx->byte.val, 0);
+  }
+
+  next_byte (ctx);
+}
+
+
+// https://graphics.stanford.edu/~seander/bithacks.html#ParityLookupTable
+#define P2(n) n, n ^ 1, n ^ 1, n
+#define P4(n) P2(n), P2(n ^ 1), P2(n ^ 1), P2(n)
+#define P6(n) P4(n), P4(n ^ 1), P4(n ^ 1), P4(n)
+static const uint8_t parity_table[256] = { P6(0), P6(1), P6(1), P6(0) };
+
+static inline bool parity (uint8_t v)
+{
+  return parity_table[v];
 }
 
 
-static void clock_falling_edge (void)
+static void clock_falling_edge (pdi_ctx_t *ctx)
 {
-  bcm2835_delayMicroseconds (pdi.delay_us);
-  bcm2835_gpio_clr (pdi.clk);
+  bcm2835_delayMicroseconds (ctx->delay_us);
+  bcm2835_gpio_clr (ctx->clk);
 }
 
 
-static void clock_rising_edge (void)
+static void clock_rising_edge (pdi_ctx_t *ctx)
 {
-  bcm2835_delayMicroseconds (pdi.delay_us);
-  bcm2835_gpio_set (pdi.clk);
+  bcm2835_delayMicroseconds (ctx->delay_us);
+  bcm2835_gpio_set (ctx->clk);
 }
 
 
-static void blind_clock (unsigned n)
+static void blind_clock (pdi_ctx_t *ctx, unsigned n)
 {
+  ctx->st->idle_clocks += n;
+  if (ctx->dry_run)
+    return;
+  if (ctx->lane)
+  {
+    ctx->lane->blind = n;
+    lane_wait (ctx);
+    return;
+  }
   while (n--)
   {
-    clock_falling_edge ();
-    clock_rising_edge ();
+    clock_falling_edge (ctx);
+    clock_rising_edge (ctx);
+  }
+}
+
+
+// drives the next outbound bit of the sequence onto the data line
+static inline void put_bit (pdi_ctx_t *ctx)
+{
+  bool bit = 0;
+  switch (ctx->byte.pos++)
+  {
+    case XF_ST: bit = 0; break;
+    case XF_0: case XF_1: case XF_2: case XF_3: // fall-through
+    case XF_4: case XF_5: case XF_6: case XF_7:
+      bit = (ctx->byte.val >> (ctx->byte.pos -1)) & 1; break;
+    case XF_PAR: bit = parity (ctx->byte.val); break;
+    case XF_SP0: bit = 1; break;
+    case XF_SP1: bit = 1; load_next_byte (ctx); break;
   }
+  if (bit)
+    bcm2835_gpio_set (ctx->data);
+  else
+    bcm2835_gpio_clr (ctx->data);
 }
 
 
-static void clock_out (void)
+static void clock_out (pdi_ctx_t *ctx)
 {
-  clock_falling_edge ();
-  if (!pdi.seq)
-    bcm2835_gpio_set (pdi.data); // IDLE
+  clock_falling_edge (ctx);
+  if (!ctx->seq)
+    bcm2835_gpio_set (ctx->data); // IDLE
   else
+    put_bit (ctx);
+  clock_rising_edge (ctx);
+}
+
+
+// takes the bit just sampled off the data line into the inbound frame
+static inline void take_bit (pdi_ctx_t *ctx, bool bit)
+{
+  switch (ctx->byte.pos)
   {
-    bool bit = 0;
-    switch (pdi.byte.pos++)
-    {
-      case XF_ST: bit = 0; break;
-      case XF_0: case XF_1: case XF_2: case XF_3: // fall-through
-      case XF_4: case XF_5: case XF_6: case XF_7:
-        bit = (pdi.byte.val >> (pdi.byte.pos -1)) & 1; break;
-      case XF_PAR: bit = parity (pdi.byte.val); break;
-      case XF_SP0: bit = 1; break;
-      case XF_SP1: bit = 1; load_next_byte (); break;
-    }
-    if (bit)
-      bcm2835_gpio_set (pdi.data);
-    else
-      bcm2835_gpio_clr (pdi.data);
+    case XF_ST:
+      ctx->byte.pos += !bit; // expect data next if low bit
+      ctx->ticks += bit; // if still idle, count timeout timer
+      ctx->st->idle_clocks += bit;
+      break;
+    case XF_0: case XF_1: case XF_2: case XF_3:
+    case XF_4: case XF_5: case XF_6: case XF_7:
+      ctx->byte.val |= (bit << ctx->byte.pos); ++ctx->byte.pos; break;
+    case XF_PAR:
+      if (bit != parity (ctx->byte.val))
+      {
+        ctx->cur_failed = true;
+        ctx->byte_flags |= PDI_TRACE_PARITY_ERR;
+      }
+      ++ctx->byte.pos;
+      break;
+    case XF_SP0: case XF_SP1:
+      if (!bit)
+      {
+        ctx->cur_failed = true;
+        ctx->byte_flags |= PDI_TRACE_STOP_ERR;
+      }
+      if (ctx->byte.pos == XF_SP1)
+        load_next_byte (ctx);
+      else
+        ++ctx->byte.pos;
+      break;
   }
-  clock_rising_edge ();
 }
 
 
-static void clock_in (void)
+static void clock_in (pdi_ctx_t *ctx)
 {
-  clock_falling_edge ();
-  clock_rising_edge ();
-  if (pdi.seq)
+  clock_falling_edge (ctx);
+  clock_rising_edge (ctx);
+  if (ctx->seq)
+    take_bit (ctx, bcm2835_gpio_lev (ctx->data) > 0);
+}
+
+
+// Receives the rest of the current inbound transfer in one go. Bit for bit
+// this does what clock_in() does, but the byte is assembled in locals and
+// stored straight into the buffer, and the context is only touched between
+// bytes. Returns early on timeout or stop, leaving pdi_run() to fail the
+// sequence, and on a bad frame, with cur_failed set.
+static void bulk_recv (pdi_ctx_t *ctx)
+{
+  pdi_transfer_t *xf = ctx->cur->xfer;
+  uint8_t *buf = (uint8_t *)xf->buf;
+  uint32_t len = xf->len;
+  uint32_t first = ctx->cur_offs;
+  uint8_t data = ctx->data;
+  uint64_t timeout = ctx->timeout_ticks;
+  uint64_t ticks = ctx->ticks;
+  uint64_t idle = 0;
+  bool tracing = ctx->trace.buf != 0;
+
+  uint32_t i;
+  for (i = first; i < len; ++i, ticks = 0)
   {
-    bool bit = (bcm2835_gpio_lev (pdi.data) > 0);
-    switch (pdi.byte.pos)
+    // idle bits until the start bit
+    for (;;)
     {
-      case XF_ST:
-        pdi.byte.pos += !bit; // expect data next if low bit
-        pdi.ticks += bit; // if still idle, count timeout timer
-        break;
-      case XF_0: case XF_1: case XF_2: case XF_3:
-      case XF_4: case XF_5: case XF_6: case XF_7:
-        pdi.byte.val |= (bit << pdi.byte.pos); ++pdi.byte.pos; break;
-      case XF_PAR:
-        if (bit != parity (pdi.byte.val)) pdi.cur_failed = true;
-        ++pdi.byte.pos;
+      clock_falling_edge (ctx);
+      clock_rising_edge (ctx);
+      if (!bcm2835_gpio_lev (data))
         break;
-      case XF_SP0: if (!bit) pdi.cur_failed = true; ++pdi.byte.pos; break;
-      case XF_SP1: if (!bit) pdi.cur_failed = true; load_next_byte (); break;
+      ++idle;
+      if (++ticks >= timeout || ctx->stop)
+        goto out;
+    }
+
+    uint8_t val = 0;
+    for (unsigned b = 0; b < 8; ++b)
+    {
+      clock_falling_edge (ctx);
+      clock_rising_edge (ctx);
+      val |= (bcm2835_gpio_lev (data) ? 1 : 0) << b;
+    }
+
+    // like clock_in(), give up on the first bad bit
+    clock_falling_edge (ctx);
+    clock_rising_edge (ctx);
+    uint8_t flags = 0;
+    if ((bcm2835_gpio_lev (data) ? 1 : 0) != parity_table[val])
+      flags = PDI_TRACE_PARITY_ERR;
+    for (unsigned sp = 0; sp < 2 && !flags; ++sp)
+    {
+      clock_falling_edge (ctx);
+      clock_rising_edge (ctx);
+      if (!bcm2835_gpio_lev (data))
+        flags = PDI_TRACE_STOP_ERR;
     }
+    if (flags)
+    {
+      ctx->cur_failed = true;
+      ctx->byte.val = val;
+      ctx->byte_flags = flags;
+      break;
+    }
+
+    buf[i] = val;
+    if (tracing)
+      trace (ctx, PDI_TRACE_RX, val, 0);
+  }
+
+out:
+  ctx->st->frames_in += i - first;
+  ctx->st->idle_clocks += idle;
+  ctx->ticks = ticks;
+  if (ctx->cur_failed)
+  {
+    ctx->cur_offs = i;
+    return; // report_done() traces the bad frame
+  }
+  ctx->byte.pos = XF_ST;
+  ctx->byte.val = 0;
+  ctx->byte_flags = 0;
+  if (i == len)
+  {
+    ctx->cur_offs = len - 1;
+    next_byte (ctx);
   }
+  else
+    ctx->cur_offs = i;
 }
 
 
-static void report_done (void)
+static void report_done (pdi_ctx_t *ctx)
 {
-  pdi_sequence_done_fn_t done = pdi.done_fn;
-  pdi_sequence_t *seq = pdi.seq;
-  pdi.done_fn = 0;
-  pdi.seq = pdi.cur = 0;
-  done (pdi.cur_failed == false, seq);
+  pdi_sequence_done_fn_t done = ctx->done_fn;
+  pdi_sequence_t *seq = ctx->seq;
+  if (ctx->cur_failed)
+  {
+    uint8_t flags = ctx->byte_flags;
+    if (ctx->ticks >= ctx->timeout_ticks)
+      flags |= PDI_TRACE_TIMEOUT;
+    if (ctx->stop)
+      flags |= PDI_TRACE_STOPPED;
+    trace (ctx, PDI_TRACE_FAIL, ctx->byte.val, flags);
+  }
+  ctx->done_fn = 0;
+  ctx->seq = ctx->cur = 0;
+  if (ctx->cur_failed)
+    pdi_shadow_invalidate (ctx); // no telling how far the target got
+  else
+  {
+    uint32_t n = 0;
+    for (pdi_sequence_t *s = seq; s; s = s->next)
+      n += s->xfer->len;
+    telemetry_add_bytes (ctx->tm, n);
+  }
+  done (ctx, ctx->cur_failed == false, seq);
 }
 
 
 // ----- Interface functions --------------------------------------------
 
-bool pdi_init (uint8_t clk_pin, uint8_t data_pin, uint16_t delay_us)
+pdi_ctx_t *pdi_init (uint8_t clk_pin, uint8_t data_pin, uint16_t delay_us)
 {
-  if (!bcm2835_init ())
-    return false;
+  static bool bcm2835_ready;
+  if (!bcm2835_ready && !bcm2835_init ())
+    return 0;
+  bcm2835_ready = true;
+
+  pdi_ctx_t *ctx = calloc (1, sizeof (pdi_ctx_t));
+  if (!ctx)
+    return 0;
+
+  ctx->stop = false;
+  ctx->clk = clk_pin;
+  ctx->data = data_pin;
+  ctx->delay_us = delay_us;
+  ctx->timeout_ticks = PDI_DEFAULT_TIMEOUT_TICKS;
+  select_stats (ctx);
+
+  return ctx;
+}
 
-  pdi.stop = false;
-  pdi.clk = clk_pin;
-  pdi.data = data_pin;
-  pdi.delay_us = delay_us;
-  pdi.timeout_ticks = 200000; // enough?
 
-  struct sched_param sp;
-  memset (&sp, 0, sizeof (sp));
-  sp.sched_priority = sched_get_priority_max (SCHED_FIFO);
-  sched_setscheduler (0, SCHED_FIFO, &sp);
-  mlockall (MCL_CURRENT | MCL_FUTURE);
+pdi_ctx_t *pdi_init_dry_run (uint16_t delay_us)
+{
+  pdi_ctx_t *ctx = calloc (1, sizeof (pdi_ctx_t));
+  if (!ctx)
+    return 0;
 
-  bcm2835_gpio_clr (pdi.data);
-  bcm2835_gpio_clr (pdi.clk);
-  bcm2835_gpio_fsel (pdi.clk, BCM2835_GPIO_FSEL_OUTP);
-  bcm2835_gpio_fsel (pdi.data, BCM2835_GPIO_FSEL_OUTP);
+  ctx->dry_run = true;
+  ctx->delay_us = delay_us;
+  ctx->timeout_ticks = PDI_DEFAULT_TIMEOUT_TICKS;
+  select_stats (ctx);
 
-  return true;
+  return ctx;
+}
+
+
+void pdi_free (pdi_ctx_t *ctx)
+{
+  if (!ctx)
+    return;
+  free (ctx->trace.buf);
+  free (ctx);
+}
+
+
+void pdi_set_run_target (pdi_ctx_t *ctx, bool run)
+{
+  ctx->run_target = run;
+}
+
+
+void pdi_set_telemetry (pdi_ctx_t *ctx, telemetry_t *tm)
+{
+  ctx->tm = tm;
+  telemetry_set_delay (tm, ctx->delay_us);
 }
 
 
-bool pdi_open (void)
+telemetry_t *pdi_telemetry (pdi_ctx_t *ctx)
 {
-  // put device into PDI mode
-  bcm2835_gpio_set (pdi.data);
-  bcm2835_delayMicroseconds (1); // xmega256a3 says 90-1000ns reset pulse width
-  blind_clock (16); // next, 16 pdi_clk cycles within 100us
+  return ctx->tm;
+}
+
 
+bool pdi_open (pdi_ctx_t *ctx)
+{
   static const char init[] = {
     STCS | PDI_REG_CONTROL, 0x07, // 2 idle bits
     STCS | PDI_REG_RESET, 0x59, // hold device in reset
     KEY, 0xFF, 0x88, 0xD8, 0xCD, 0x45, 0xAB, 0x89, 0x12, // enable NVM
   };
+  uint32_t init_len = ctx->run_target ? 2 : sizeof (init);
 
-  return pdi_send (init, sizeof (init));
+  select_stats (ctx);
+  pdi_shadow_invalidate (ctx);
+  if (ctx->dry_run)
+  {
+    blind_clock (ctx, 16);
+    return pdi_send (ctx, init, init_len);
+  }
+
+  // realtime from here until pdi_close(), so repeated open/close cycles
+  // (e.g. when probing for a target) don't hog a core in between
+  if (thread_open_count++ == 0)
+  {
+    struct sched_param sp;
+    memset (&sp, 0, sizeof (sp));
+    sp.sched_priority = sched_get_priority_max (SCHED_FIFO);
+    sched_setscheduler (0, SCHED_FIFO, &sp);
+  }
+  if (__sync_fetch_and_add (&open_count, 1) == 0)
+    mlockall (MCL_CURRENT | MCL_FUTURE);
+
+  if (ctx->run_target)
+  {
+    // the clock pin is the target's RESET; drive it high from the start and
+    // clock right away, so a running target never sees it low
+    bcm2835_gpio_set (ctx->data);
+    bcm2835_gpio_set (ctx->clk);
+    gpio_fsel (ctx->clk, BCM2835_GPIO_FSEL_OUTP);
+    gpio_fsel (ctx->data, BCM2835_GPIO_FSEL_OUTP);
+    trace (ctx, PDI_TRACE_OPEN, 0, 0);
+  }
+  else
+  {
+    bcm2835_gpio_clr (ctx->data);
+    bcm2835_gpio_clr (ctx->clk);
+    gpio_fsel (ctx->clk, BCM2835_GPIO_FSEL_OUTP);
+    gpio_fsel (ctx->data, BCM2835_GPIO_FSEL_OUTP);
+
+    // put device into PDI mode
+    trace (ctx, PDI_TRACE_OPEN, 0, 0);
+    bcm2835_gpio_set (ctx->data);
+    bcm2835_delayMicroseconds (1); // xmega256a3 says 90-1000ns reset pulse width
+  }
+  if (ctx->lane)
+    ctx->lane->active = true;
+  blind_clock (ctx, 16); // next, 16 pdi_clk cycles within 100us
+
+  return pdi_send (ctx, init, init_len);
 }
 
 
-void pdi_close (void)
+// keeps the clock low for a while; a lane lets the rest of its group
+// carry on meanwhile
+static void hold_clock_low (pdi_ctx_t *ctx, uint32_t us)
 {
+  if (!ctx->lane)
+  {
+    bcm2835_delayMicroseconds (us);
+    return;
+  }
+  ctx->lane->active = false;
+  ctx->lane->hold_until = bcm2835_st_read () + us;
+  lane_wait (ctx);
+}
+
+
+void pdi_close (pdi_ctx_t *ctx)
+{
+  pdi_keepalive_end (ctx);
+
   static const char deinit[] = {
     STCS | PDI_REG_RESET, 0x00,
     LDCS | PDI_REG_RESET
   };
   char status;
   do {
-    if (!pdi_sendrecv (deinit, sizeof (deinit), &status, 1))
+    if (!pdi_sendrecv (ctx, deinit, sizeof (deinit), &status, 1))
       break; // oh well...
   } while (status != 0x00);
+  pdi_shadow_invalidate (ctx);
 
-  // drop out of PDI mode
-  bcm2835_gpio_clr (pdi.data);
-  bcm2835_gpio_clr (pdi.clk);
-  bcm2835_delayMicroseconds (300); // 100us documented, observed to be ~200us
+  if (ctx->dry_run)
+    return;
 
-  // give it a good reset pulse before we relinquish the gpio pins
-  bcm2835_gpio_set (pdi.clk);
-  bcm2835_delayMicroseconds (1);
-  bcm2835_gpio_clr (pdi.clk);
-  bcm2835_delayMicroseconds (1);
+  // drop out of PDI mode
+  trace (ctx, PDI_TRACE_CLOSE, 0, 0);
+  if (ctx->run_target)
+  {
+    // leave RESET high; unclocked, the PDI times out on its own and the
+    // target carries on
+    bcm2835_gpio_set (ctx->clk);
+  }
+  else
+  {
+    bcm2835_gpio_clr (ctx->data);
+    bcm2835_gpio_clr (ctx->clk);
+    hold_clock_low (ctx, 300); // 100us documented, observed to be ~200us
+
+    // give it a good reset pulse before we relinquish the gpio pins
+    bcm2835_gpio_set (ctx->clk);
+    bcm2835_delayMicroseconds (1);
+    bcm2835_gpio_clr (ctx->clk);
+    bcm2835_delayMicroseconds (1);
+  }
 
   // release gpio pins; libbcm2835 currently does not provide a way to read
   // the initial fsel state, so we can't properly restore the state here
-  bcm2835_gpio_fsel (pdi.clk, BCM2835_GPIO_FSEL_INPT);
-  bcm2835_gpio_fsel (pdi.data, BCM2835_GPIO_FSEL_INPT);
+  gpio_fsel (ctx->clk, BCM2835_GPIO_FSEL_INPT);
+  gpio_fsel (ctx->data, BCM2835_GPIO_FSEL_INPT);
 
-  struct sched_param sp;
-  memset (&sp, 0, sizeof (sp));
-  sp.sched_priority = 0;
-  sched_setscheduler (0, SCHED_OTHER, &sp);
-  munlockall ();
+  if (--thread_open_count == 0)
+  {
+    struct sched_param sp;
+    memset (&sp, 0, sizeof (sp));
+    sp.sched_priority = 0;
+    sched_setscheduler (0, SCHED_OTHER, &sp);
+  }
+  if (__sync_sub_and_fetch (&open_count, 1) == 0)
+    munlockall ();
 }
 
 
-bool pdi_set_sequence (pdi_sequence_t *seq, pdi_sequence_done_fn_t fn)
+bool pdi_set_sequence (
+  pdi_ctx_t *ctx, pdi_sequence_t *seq, pdi_sequence_done_fn_t fn)
 {
-  if (pdi.seq || pdi.done_fn)
+  if (ctx->seq || ctx->done_fn || ctx->ka.state != KA_IDLE)
     return false;
 
-  pdi.done_fn = fn;
-  pdi.seq = pdi.cur = seq;
-  pdi.cur_failed = false;
-  pdi.cur_offs = 0;
-  pdi.byte.pos = XF_ST;
+  ctx->done_fn = fn;
+  ctx->seq = ctx->cur = seq;
+  ctx->cur_failed = false;
+  ctx->cur_offs = 0;
+  ctx->byte.pos = XF_ST;
+  ctx->byte_flags = 0;
   if (seq->xfer->dir == PDI_IN)
-    pdi.byte.val = 0;
+    ctx->byte.val = 0;
   else
-    pdi.byte.val = (uint8_t)seq->xfer->buf[0];
+    ctx->byte.val = (uint8_t)seq->xfer->buf[0];
 
-  pdi.switch_dir = true; // ensure we do the right thing next
-  pdi.ticks = 0;
+  ctx->switch_dir = true; // ensure we do the right thing next
+  ctx->ticks = 0;
+  select_stats (ctx);
+  ++ctx->st->sequences;
 
   return true;
 }
 
 
-void pdi_run (void)
+// Stands in for clocking out a sequence in dry runs. The accounting mirrors
+// pdi_run(), and the target is assumed to answer after the guard time with
+// a status that keeps the NVM layer happy: NVM enabled, controller idle,
+// and zeroes for everything else.
+static void dry_run_sequence (pdi_ctx_t *ctx)
+{
+  uint8_t last_out = 0;
+  bool first = true;
+  pdi_dir_t dir = PDI_OUT;
+  for (pdi_sequence_t *s = ctx->seq; s; s = s->next)
+  {
+    pdi_transfer_t *xf = s->xfer;
+    if (first || xf->dir != dir)
+    {
+      ++ctx->st->dir_switches;
+      ctx->st->idle_clocks += (xf->dir == PDI_OUT) ? 2 : 0;
+    }
+    first = false;
+    dir = xf->dir;
+
+    if (dir == PDI_OUT)
+    {
+      ctx->st->frames_out += xf->len;
+      last_out = (uint8_t)xf->buf[xf->len - 1];
+    }
+    else
+    {
+      ctx->st->frames_in += xf->len;
+      ctx->st->idle_clocks += DRY_RX_GUARD_CLOCKS;
+      memset (xf->buf, 0, xf->len);
+      if (last_out == (LDCS | PDI_REG_STATUS))
+        xf->buf[0] = 0x02; // NVMEN
+    }
+  }
+
+  ctx->cur = 0;
+  report_done (ctx);
+}
+
+
+void pdi_run (pdi_ctx_t *ctx)
 {
-  while (!pdi.stop && pdi.seq && pdi.ticks < pdi.timeout_ticks)
+  if (ctx->dry_run && ctx->seq)
+  {
+    dry_run_sequence (ctx);
+    return;
+  }
+
+  if (ctx->lane)
+  {
+    if (ctx->seq)
+      lane_wait (ctx); // the group's clock loop runs it
+    return;
+  }
+
+  while (!ctx->stop && ctx->seq && ctx->ticks < ctx->timeout_ticks)
   {
-    if (pdi.switch_dir)
+    if (ctx->switch_dir)
     {
-      if (pdi.cur->xfer->dir == PDI_OUT)
+      ++ctx->st->dir_switches;
+      if (ctx->cur->xfer->dir == PDI_OUT)
       {
-        bcm2835_gpio_set (pdi.data);
-        bcm2835_gpio_fsel (pdi.data, BCM2835_GPIO_FSEL_OUTP);
-        blind_clock (2); // minimum 1 clock in this transition direction
+        bcm2835_gpio_set (ctx->data);
+        gpio_fsel (ctx->data, BCM2835_GPIO_FSEL_OUTP);
+        blind_clock (ctx, 2); // minimum 1 clock in this transition direction
       }
       else
       {
-        bcm2835_gpio_fsel (pdi.data, BCM2835_GPIO_FSEL_INPT);
+        gpio_fsel (ctx->data, BCM2835_GPIO_FSEL_INPT);
         // a variable number of idle clocks required before start bit received,
         // this will happen automatically by clock_in()
       }
 
-      pdi.switch_dir = false;
+      ctx->switch_dir = false;
     }
 
-    if (pdi.cur->xfer->dir == PDI_OUT)
-      clock_out ();
+    if (ctx->cur->xfer->dir == PDI_OUT)
+      clock_out (ctx);
+    else if (ctx->byte.pos == XF_ST &&
+             ctx->cur->xfer->len - ctx->cur_offs >= BULK_RX_MIN_LEN)
+      bulk_recv (ctx);
     else
-      clock_in ();
+      clock_in (ctx);
+
+    if ((ctx->seq && !ctx->cur) || ctx->cur_failed) // just finished, or failed
+      report_done (ctx);
+  }
+
+  if ((ctx->stop || ctx->ticks >= ctx->timeout_ticks) && ctx->done_fn)
+  {
+    ctx->cur_failed = true;
+    report_done (ctx);
+  }
+}
+
+
+bool pdi_break (pdi_ctx_t *ctx)
+{
+  if (ctx->seq || ctx->done_fn || ctx->ka.state != KA_IDLE)
+    return false;
+
+  trace (ctx, PDI_TRACE_BREAK, 0, 0);
+  select_stats (ctx);
+  pdi_shadow_invalidate (ctx);
+  if (!ctx->dry_run)
+    gpio_fsel (ctx->data, BCM2835_GPIO_FSEL_OUTP);
+  blind_clock (ctx, 12);
+  blind_clock (ctx, 12);
+  return true;
+}
+
+
+void pdi_stop (pdi_ctx_t *ctx)
+{
+  ctx->stop = true;
+}
+
+
+void pdi_set_timeout (pdi_ctx_t *ctx, uint32_t ticks)
+{
+  ctx->timeout_ticks = ticks;
+}
+
+
+static void *keepalive_thread (void *arg)
+{
+  pdi_ctx_t *ctx = arg;
+
+  ctx->ka.state = KA_READY;
+  while (ctx->ka.state == KA_READY)
+    ;
+
+  uint64_t n = 0;
+  while (ctx->ka.state == KA_RUNNING)
+  {
+    clock_falling_edge (ctx);
+    clock_rising_edge (ctx);
+    ++n;
+  }
+  ctx->ka.clocks = n;
+  __sync_synchronize ();
+
+  // hands the pins back; ctx must not be touched after this
+  ctx->ka.state = KA_IDLE;
+  return 0;
+}
+
+
+bool pdi_keepalive_begin (pdi_ctx_t *ctx)
+{
+  if (ctx->seq || ctx->done_fn || ctx->ka.state != KA_IDLE)
+    return false;
+
+  if (ctx->dry_run)
+  {
+    ctx->ka.state = KA_RUNNING;
+    return true;
+  }
+
+  // a lane's pins are the group's to clock
+  if (ctx->lane)
+    return false;
+
+  // the helper spins, so it needs a core other than ours; a target thread
+  // is pinned to its own, so go by what the process (its main thread) may
+  // use, and leave it to the scheduler to put a realtime thread where no
+  // other one is running, i.e. not on another target's core
+  cpu_set_t cpus;
+  if (sched_getaffinity (getpid (), sizeof (cpus), &cpus) != 0)
+    return false;
+  CPU_CLR (sched_getcpu (), &cpus);
+  if (!CPU_COUNT (&cpus))
+    return false;
+
+  pthread_attr_t attr;
+  struct sched_param sp;
+  memset (&sp, 0, sizeof (sp));
+  sp.sched_priority = sched_get_priority_max (SCHED_FIFO);
+  pthread_attr_init (&attr);
+  pthread_attr_setinheritsched (&attr, PTHREAD_EXPLICIT_SCHED);
+  pthread_attr_setschedpolicy (&attr, SCHED_FIFO);
+  pthread_attr_setschedparam (&attr, &sp);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  pthread_attr_setaffinity_np (&attr, sizeof (cpus), &cpus);
+
+  // idle is a high data line, driven by us
+  bcm2835_gpio_set (ctx->data);
+  gpio_fsel (ctx->data, BCM2835_GPIO_FSEL_OUTP);
+
+  pthread_t thread;
+  ctx->ka.state = KA_STARTING;
+  int err = pthread_create (&thread, &attr, keepalive_thread, ctx);
+  pthread_attr_destroy (&attr);
+  if (err)
+  {
+    ctx->ka.state = KA_IDLE;
+    return false;
+  }
+
+  // thread startup takes longer than the target will wait for a clock
+  select_stats (ctx);
+  uint64_t n = 0;
+  while (ctx->ka.state != KA_READY)
+  {
+    clock_falling_edge (ctx);
+    clock_rising_edge (ctx);
+    ++n;
+  }
+  ctx->st->idle_clocks += n;
+  ctx->ka.state = KA_RUNNING;
+  return true;
+}
+
+
+void pdi_keepalive_end (pdi_ctx_t *ctx)
+{
+  if (ctx->ka.state != KA_RUNNING)
+    return;
+
+  if (ctx->dry_run)
+  {
+    ctx->ka.state = KA_IDLE;
+    return;
+  }
+
+  ctx->ka.state = KA_STOPPING;
+  while (ctx->ka.state != KA_IDLE)
+    ;
+  __sync_synchronize ();
+  select_stats (ctx);
+  ctx->st->idle_clocks += ctx->ka.clocks;
+}
+
+
+// parks the calling lane until the clock loop has done its link work
+static void lane_wait (pdi_ctx_t *ctx)
+{
+  pdi_lane_t *l = ctx->lane;
+  l->waiting = true;
+  swapcontext (&l->uc, &running_group->sched);
+}
+
+
+static void lane_main (void)
+{
+  pdi_lane_t *l = running_group->cur;
+  l->fn (l->ctx, l->arg);
+  l->done = true; // back to the scheduler through uc_link
+}
+
+
+static void lane_resume (pdi_group_t *g, pdi_lane_t *l)
+{
+  // errinfo is per thread, and the lanes share one
+  g->cur = l;
+  set_errinfo (l->err, l->errloc);
+  swapcontext (&g->sched, &l->uc);
+  get_errinfo (&l->err, &l->errloc);
+}
 
-    if ((pdi.seq && !pdi.cur) || pdi.cur_failed) // just finished, or failed
-      report_done ();
+
+// a lane's share of the clock cycle while the clocks are low: switching
+// direction, or driving its next bit
+static void lane_out (pdi_lane_t *l)
+{
+  pdi_ctx_t *ctx = l->ctx;
+  if (l->blind || !ctx->seq)
+    return;
+
+  if (ctx->switch_dir)
+  {
+    ++ctx->st->dir_switches;
+    ctx->switch_dir = false;
+    if (ctx->cur->xfer->dir == PDI_OUT)
+    {
+      bcm2835_gpio_set (ctx->data);
+      gpio_fsel (ctx->data, BCM2835_GPIO_FSEL_OUTP);
+      l->blind = 2; // minimum 1 clock in this transition direction
+      ctx->st->idle_clocks += 2;
+      return;
+    }
+    gpio_fsel (ctx->data, BCM2835_GPIO_FSEL_INPT);
   }
 
-  if ((pdi.stop || pdi.ticks >= pdi.timeout_ticks) && pdi.done_fn)
+  if (ctx->cur->xfer->dir == PDI_OUT)
+    put_bit (ctx);
+}
+
+
+// ...and once they're high again: sampling its bit, and wrapping up
+static void lane_in (pdi_lane_t *l)
+{
+  pdi_ctx_t *ctx = l->ctx;
+  if (l->blind)
+    --l->blind;
+  else if (ctx->cur && ctx->cur->xfer->dir == PDI_IN)
+    take_bit (ctx, bcm2835_gpio_lev (ctx->data) > 0);
+  if (l->blind)
+    return;
+
+  if (ctx->seq)
   {
-    pdi.cur_failed = true;
-    report_done ();
+    if (!ctx->cur || ctx->cur_failed)
+      report_done (ctx);
+    else if (ctx->stop || ctx->ticks >= ctx->timeout_ticks)
+    {
+      ctx->cur_failed = true;
+      report_done (ctx);
+    }
   }
+  if (!ctx->seq)
+    l->waiting = false;
+}
+
+
+static void group_clock (pdi_group_t *g, uint32_t mask, uint64_t delay_us)
+{
+  bcm2835_delayMicroseconds (delay_us);
+  bcm2835_gpio_clr_multi (mask);
+  for (unsigned i = 0; i < g->n; ++i)
+    if (g->lanes[i].waiting && g->lanes[i].active)
+      lane_out (&g->lanes[i]);
+
+  bcm2835_delayMicroseconds (delay_us);
+  bcm2835_gpio_set_multi (mask);
+  for (unsigned i = 0; i < g->n; ++i)
+    if (g->lanes[i].waiting && g->lanes[i].active)
+      lane_in (&g->lanes[i]);
+}
+
+
+pdi_group_t *pdi_group_init (void)
+{
+  return calloc (1, sizeof (pdi_group_t));
 }
 
 
-bool pdi_break (void)
+bool pdi_group_add (
+  pdi_group_t *g, pdi_ctx_t *ctx, pdi_lane_fn_t fn, void *arg)
 {
-  if (pdi.seq || pdi.done_fn)
+  if (g->n == PDI_GROUP_MAX_LANES || (!ctx->dry_run && ctx->clk >= 32) ||
+      (g->n && ctx->delay_us != g->lanes[0].ctx->delay_us))
     return false;
 
-  bcm2835_gpio_fsel (pdi.data, BCM2835_GPIO_FSEL_OUTP);
-  blind_clock (12);
-  blind_clock (12);
+  pdi_lane_t *l = &g->lanes[g->n];
+  l->stack = malloc (LANE_STACK_SIZE);
+  if (!l->stack)
+    return false;
+  l->ctx = ctx;
+  l->fn = fn;
+  l->arg = arg;
+  ++g->n;
   return true;
 }
 
 
-void pdi_stop (void)
+void pdi_group_run (pdi_group_t *g)
+{
+  const char *err;
+  int errloc;
+  get_errinfo (&err, &errloc);
+  running_group = g;
+
+  for (unsigned i = 0; i < g->n; ++i)
+  {
+    pdi_lane_t *l = &g->lanes[i];
+    getcontext (&l->uc);
+    l->uc.uc_stack.ss_sp = l->stack;
+    l->uc.uc_stack.ss_size = LANE_STACK_SIZE;
+    l->uc.uc_link = &g->sched;
+    makecontext (&l->uc, lane_main, 0);
+    l->done = l->waiting = l->active = false;
+    l->blind = 0;
+    l->err = 0;
+    l->errloc = -1;
+    l->ctx->lane = l;
+  }
+
+  uint64_t delay_us = g->n ? g->lanes[0].ctx->delay_us : 0;
+  for (;;)
+  {
+    // lanes run until they need their link, then everything that's waiting
+    // gets a clock cycle; no lane is ever left unclocked for longer than
+    // it takes the others to set up their next sequence
+    bool running = false;
+    uint32_t mask = 0;
+    for (unsigned i = 0; i < g->n; ++i)
+    {
+      pdi_lane_t *l = &g->lanes[i];
+      if (!l->done && !l->waiting)
+        lane_resume (g, l);
+      if (l->done)
+        continue;
+      running = true;
+      if (l->active)
+        mask |= 1u << l->ctx->clk;
+      else if (bcm2835_st_read () >= l->hold_until)
+        l->waiting = false;
+    }
+    if (!running)
+      break;
+    if (mask)
+      group_clock (g, mask, delay_us);
+  }
+
+  for (unsigned i = 0; i < g->n; ++i)
+    g->lanes[i].ctx->lane = 0;
+  running_group = 0;
+  set_errinfo (err, errloc);
+}
+
+
+void pdi_group_free (pdi_group_t *g)
 {
-  pdi.stop = true;
+  if (!g)
+    return;
+  for (unsigned i = 0; i < g->n; ++i)
+    free (g->lanes[i].stack);
+  free (g);
+}
+
+
+pdi_shadow_t *pdi_shadow (pdi_ctx_t *ctx)
+{
+  return &ctx->shadow;
+}
+
+
+void pdi_shadow_invalidate (pdi_ctx_t *ctx)
+{
+  memset (&ctx->shadow, 0, sizeof (ctx->shadow));
+}
+
+
+void pdi_model_busy (pdi_ctx_t *ctx, uint32_t us)
+{
+  if (ctx->dry_run)
+  {
+    select_stats (ctx);
+    ctx->st->busy_us += us;
+  }
+}
+
+
+bool pdi_get_stats (pdi_ctx_t *ctx, uint32_t phase, pdi_stats_t *out)
+{
+  if (phase >= PDI_STATS_PHASES)
+    return false;
+  *out = ctx->stats[phase];
+  return true;
+}
+
+
+bool pdi_trace_enable (pdi_ctx_t *ctx, uint32_t max_records)
+{
+  pdi_trace_rec_t *buf = calloc (max_records, sizeof (pdi_trace_rec_t));
+  if (!max_records || !buf)
+  {
+    free (buf);
+    return false;
+  }
+
+  free (ctx->trace.buf);
+  ctx->trace.buf = buf;
+  ctx->trace.cap = max_records;
+  ctx->trace.head = 0;
+  ctx->trace.total = 0;
+  return true;
+}
+
+
+bool pdi_trace_save (pdi_ctx_t *ctx, const char *fname)
+{
+  if (!ctx->trace.buf)
+    return false;
+
+  FILE *f = fopen (fname, "wb");
+  if (!f)
+    return false;
+
+  pdi_trace_hdr_t hdr;
+  memset (&hdr, 0, sizeof (hdr));
+  memcpy (hdr.magic, PDI_TRACE_MAGIC, sizeof (hdr.magic));
+  hdr.version = PDI_TRACE_VERSION;
+  hdr.delay_us = ctx->delay_us;
+  if (ctx->trace.total > ctx->trace.cap)
+  {
+    hdr.count = ctx->trace.cap;
+    hdr.dropped = ctx->trace.total - ctx->trace.cap;
+  }
+  else
+    hdr.count = ctx->trace.total;
+
+  // oldest record is at head if we've wrapped, else at the start
+  uint32_t first = hdr.dropped ? ctx->trace.head : 0;
+  uint32_t tail = hdr.dropped ? ctx->trace.cap - first : hdr.count;
+  bool ok =
+    fwrite (&hdr, sizeof (hdr), 1, f) == 1 &&
+    fwrite (ctx->trace.buf + first, sizeof (pdi_trace_rec_t), tail, f) ==
+      tail &&
+    fwrite (ctx->trace.buf, sizeof (pdi_trace_rec_t), hdr.count - tail, f) ==
+      hdr.count - tail;
+
+  return (fclose (f) == 0) && ok;
 }
 
 
-static bool hlapi_result;
-static void hlapi_result_fn (bool success, pdi_sequence_t *seq)
+static void hlapi_result_fn (
+  pdi_ctx_t *ctx, bool success, pdi_sequence_t *seq)
 {
   (void)seq;
-  hlapi_result = success;
+  ctx->hlapi_result = success;
 }
 
 
-bool pdi_send (const char *buf, uint32_t len)
+bool pdi_send (pdi_ctx_t *ctx, const char *buf, uint32_t len)
 {
   pdi_transfer_t xf;
   xf.buf = (char *)buf;
@@ -353,15 +1231,15 @@ bool pdi_send (const char *buf, uint32_t len)
   pdi_sequence_t seq;
   seq.next = 0;
   seq.xfer = &xf;
-  if (!pdi_set_sequence (&seq, hlapi_result_fn))
+  if (!pdi_set_sequence (ctx, &seq, hlapi_result_fn))
     return false;
 
-  pdi_run ();
-  return hlapi_result;
+  pdi_run (ctx);
+  return ctx->hlapi_result;
 }
 
 
-bool pdi_recv (char *buf, uint32_t len)
+bool pdi_recv (pdi_ctx_t *ctx, char *buf, uint32_t len)
 {
   pdi_transfer_t xf;
   xf.buf = (char *)buf;
@@ -370,15 +1248,16 @@ bool pdi_recv (char *buf, uint32_t len)
   pdi_sequence_t seq;
   seq.next = 0;
   seq.xfer = &xf;
-  if (!pdi_set_sequence (&seq, hlapi_result_fn))
+  if (!pdi_set_sequence (ctx, &seq, hlapi_result_fn))
     return false;
 
-  pdi_run ();
-  return hlapi_result;
+  pdi_run (ctx);
+  return ctx->hlapi_result;
 }
 
 
-bool pdi_sendrecv (const char *cmd, uint32_t cmdlen, char *buf, uint32_t rxlen)
+bool pdi_sendrecv (
+  pdi_ctx_t *ctx, const char *cmd, uint32_t cmdlen, char *buf, uint32_t rxlen)
 {
   pdi_transfer_t xf[2];
   xf[0].buf = (char *)cmd;
@@ -393,9 +1272,9 @@ bool pdi_sendrecv (const char *cmd, uint32_t cmdlen, char *buf, uint32_t rxlen)
   seq[0].xfer = &xf[0];
   seq[1].xfer = &xf[1];
 
-  if (!pdi_set_sequence (seq, hlapi_result_fn))
+  if (!pdi_set_sequence (ctx, seq, hlapi_result_fn))
     return false;
 
-  pdi_run ();
-  return hlapi_result;
+  pdi_run (ctx);
+  return ctx->hlapi_result;
 }
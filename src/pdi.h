@@ -11,18 +11,47 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "telemetry.h"
 
 #define PDI_REG_STATUS  0x00
 #define PDI_REG_RESET   0x01
 #define PDI_REG_CONTROL 0x02
 
+// where the CPU's data space (i/o, sram) appears in the PDI address space
+#define PDI_DATA_SPACE_BASE 0x01000000
+
+#define PDI_DEFAULT_TIMEOUT_TICKS 200000 // enough?
+
+// All link state lives in a context, one per target (clk/data pin pair).
+// A context must only be driven from one thread at a time, but contexts
+// on different pins may run concurrently, each on its own core.
+typedef struct pdi_ctx pdi_ctx_t;
+
 // --- Initialisation (including pushing the device into PDI mode) ---
+// the calling thread runs realtime and memory-locked between open and close
+
+// returns a new context, or null
+pdi_ctx_t *pdi_init (uint8_t clk_pin, uint8_t data_pin, uint16_t delay_us);
+
+// returns a context that never touches gpio, but counts the frames and
+// clocks everything would take; all reads see an idle, NVM-enabled target
+pdi_ctx_t *pdi_init_dry_run (uint16_t delay_us);
 
-bool pdi_init (uint8_t clk_pin, uint8_t data_pin, uint16_t delay_us);
+void pdi_free (pdi_ctx_t *ctx);
 
-bool pdi_open (void);
+bool pdi_open (pdi_ctx_t *ctx);
 
-void pdi_close (void);
+// by default pdi_open() holds the target in reset and enables NVM access;
+// with run set, it only attaches, and neither it nor pdi_close() ever
+// pull RESET (the clock pin) low, so the target keeps running (e.g. to
+// watch its data space)
+void pdi_set_run_target (pdi_ctx_t *ctx, bool run);
+
+void pdi_close (pdi_ctx_t *ctx);
+
+// telemetry block to report progress into, may be null (the default)
+void pdi_set_telemetry (pdi_ctx_t *ctx, telemetry_t *tm);
+telemetry_t *pdi_telemetry (pdi_ctx_t *ctx);
 
 
 // --- Low-level API -------------------------------------------------
@@ -70,25 +99,126 @@ typedef struct pdi_sequence
   struct pdi_sequence *next;
 } pdi_sequence_t;
 
-typedef void (*pdi_sequence_done_fn_t) (bool success, pdi_sequence_t *seq);
+typedef void (*pdi_sequence_done_fn_t) (
+  pdi_ctx_t *ctx, bool success, pdi_sequence_t *seq);
 
 
 // returns false if a job is already in progress
 // null ptrs or zero-length transfers NOT supported
-bool pdi_set_sequence (pdi_sequence_t *sequence, pdi_sequence_done_fn_t fn);
+bool pdi_set_sequence (
+  pdi_ctx_t *ctx, pdi_sequence_t *sequence, pdi_sequence_done_fn_t fn);
 
 // sends the double-break indication (unless a sequence is in progress)
-bool pdi_break (void);
+bool pdi_break (pdi_ctx_t *ctx);
+
+void pdi_run (pdi_ctx_t *ctx);
+
+// async-signal-safe
+void pdi_stop (pdi_ctx_t *ctx);
+
+// number of idle clocks to wait for a response before failing a sequence
+void pdi_set_timeout (pdi_ctx_t *ctx, uint32_t ticks);
+
+// Hands the link to a realtime helper on another core, which keeps clocking
+// idle bits so the target stays in PDI mode while the caller does slow
+// things (printing, file i/o). No sequences may be run until _end(), which
+// takes the link back. Fails while a sequence is in progress, or if there's
+// no other core to run the helper on.
+bool pdi_keepalive_begin (pdi_ctx_t *ctx);
+
+void pdi_keepalive_end (pdi_ctx_t *ctx);
+
+
+// --- Lock-step groups ----------------------------------------------
+
+// Several links driven from a single thread. Each lane runs a function
+// (typically a whole open/program/close job through the NVM layer) as a
+// coroutine; whenever lanes wait on their links, all of them are clocked
+// together, one gpio write per edge for all their clock pins, each lane
+// sending or receiving its own bits. So while one target's NVM controller
+// is busy, the others' page buffers are being filled, and every target
+// stays clocked without needing a core of its own. Lanes must share a
+// delay, and have their clock pins among gpio 0..31. The keep-alive is not
+// available to lanes.
+#define PDI_GROUP_MAX_LANES 8
+
+typedef struct pdi_group pdi_group_t;
+
+typedef void (*pdi_lane_fn_t) (pdi_ctx_t *ctx, void *arg);
+
+pdi_group_t *pdi_group_init (void);
+
+// false if the group is full, or ctx can't be clocked with the others
+bool pdi_group_add (
+  pdi_group_t *g, pdi_ctx_t *ctx, pdi_lane_fn_t fn, void *arg);
+
+// returns once all lane functions have
+void pdi_group_run (pdi_group_t *g);
+
+void pdi_group_free (pdi_group_t *g);
+
+
+// --- Target state shadow -------------------------------------------
+
+// What the layers above last left in target registers, so they can skip
+// reloading them. The link invalidates it whenever that knowledge may be
+// stale: on open, close, break and any failed sequence.
+typedef struct
+{
+  bool ptr_valid;
+  uint32_t ptr;       // PDI pointer register
+  bool nvm_cmd_valid;
+  uint8_t nvm_cmd;    // NVM controller CMD register
+  bool nvm_idle;      // NVM controller known not to be busy
+} pdi_shadow_t;
+
+pdi_shadow_t *pdi_shadow (pdi_ctx_t *ctx);
+
+void pdi_shadow_invalidate (pdi_ctx_t *ctx);
+
+
+// --- Link statistics -----------------------------------------------
+
+// gpio access overhead per PDI clock on a Pi 2, on top of 2x delay_us;
+// a nominal figure for estimates
+#define PDI_BIT_OVERHEAD_NS 300
+#define PDI_FRAME_BITS      12
+
+// kept per telemetry phase (see telemetry.h)
+#define PDI_STATS_PHASES    (TM_FAILED + 1)
+
+typedef struct
+{
+  uint64_t sequences;
+  uint64_t frames_out;
+  uint64_t frames_in;
+  uint64_t dir_switches;
+  uint64_t idle_clocks;  // clocks not carrying a frame bit
+  uint64_t busy_us;      // modelled NVM busy time, dry runs only
+} pdi_stats_t;
+
+bool pdi_get_stats (pdi_ctx_t *ctx, uint32_t phase, pdi_stats_t *out);
+
+// lets the NVM layer account for time the target would spend busy, which a
+// dry run can't observe through status polls; no-op on real links
+void pdi_model_busy (pdi_ctx_t *ctx, uint32_t us);
+
+
+// --- Bus trace capture ---------------------------------------------
 
-void pdi_run (void);
+// preallocates a ring buffer for max_records frames/events and starts
+// recording into it; call before pdi_open() so the RT section never allocates
+bool pdi_trace_enable (pdi_ctx_t *ctx, uint32_t max_records);
 
-void pdi_stop (void);
+// writes the captured trace (see pdi_trace.h) - only after pdi_close()!
+bool pdi_trace_save (pdi_ctx_t *ctx, const char *fname);
 
 
 // --- High-level API - be mindful of clock gaps - no printf'ing! -----
 
-bool pdi_send (const char *buf, uint32_t len);
-bool pdi_recv (char *buf, uint32_t len);
-bool pdi_sendrecv (const char *cmd, uint32_t cmdlen, char *buf, uint32_t rxlen);
+bool pdi_send (pdi_ctx_t *ctx, const char *buf, uint32_t len);
+bool pdi_recv (pdi_ctx_t *ctx, char *buf, uint32_t len);
+bool pdi_sendrecv (
+  pdi_ctx_t *ctx, const char *cmd, uint32_t cmdlen, char *buf, uint32_t rxlen);
 
 #endif
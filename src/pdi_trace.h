@@ -0,0 +1,56 @@
+/* Copyright (C) 2015 DiUS Computing Pty. Ltd.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#ifndef _PDI_TRACE_H_
+#define _PDI_TRACE_H_
+
+#include <stdint.h>
+
+// On-disk (and in-memory) format of a PDI bus trace, as captured by pdi.c
+// and decoded by pdi-trace. Host byte order, which on a Pi is little endian.
+
+#define PDI_TRACE_MAGIC   "PDITRACE"
+#define PDI_TRACE_VERSION 1
+
+// record kinds
+enum {
+  PDI_TRACE_TX    = 0, // val = byte sent
+  PDI_TRACE_RX    = 1, // val = byte received
+  PDI_TRACE_OPEN  = 2, // device pushed into PDI mode
+  PDI_TRACE_BREAK = 3, // double-break sent
+  PDI_TRACE_CLOSE = 4, // device released
+  PDI_TRACE_FAIL  = 5  // sequence aborted, val = partial byte
+};
+
+// record flags
+enum {
+  PDI_TRACE_PARITY_ERR = (1 << 0),
+  PDI_TRACE_STOP_ERR   = (1 << 1),
+  PDI_TRACE_TIMEOUT    = (1 << 2),
+  PDI_TRACE_STOPPED    = (1 << 3)
+};
+
+typedef struct
+{
+  uint32_t ts_us;  // relative to the first record
+  uint8_t  kind;
+  uint8_t  val;
+  uint8_t  flags;
+  uint8_t  reserved;
+} pdi_trace_rec_t;
+
+typedef struct
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t delay_us;
+  uint32_t count;   // number of records following
+  uint32_t dropped; // records lost to ring buffer wrap-around
+} pdi_trace_hdr_t;
+
+#endif
@@ -0,0 +1,422 @@
+/* Copyright (C) 2015 DiUS Computing Pty. Ltd.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+// Offline decoder for traces captured with "pdi -t tracefile". Turns the raw
+// frames back into PDI instructions, annotates the ones that poke the NVM
+// controller, and optionally exports a VCD for viewing in e.g. gtkwave.
+
+#include "pdi_trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#define NVM_REG_BASE 0x010001C0
+#define NVM_REG_CMD    (NVM_REG_BASE + 0x0A)
+#define NVM_REG_CTRLA  (NVM_REG_BASE + 0x0B)
+#define NVM_REG_STATUS (NVM_REG_BASE + 0x0F)
+
+static const char *nvm_cmd_name (uint8_t cmd)
+{
+  switch (cmd)
+  {
+    case 0x00: return "NOP";
+    case 0x40: return "CHIP_ERASE";
+    case 0x43: return "READ";
+    case 0x23: return "LOAD_PAGE_BUF";
+    case 0x26: return "ERASE_PAGE_BUF";
+    case 0x2B: return "ERASE_FLASH_PAGE";
+    case 0x2E: return "WRITE_FLASH_PAGE";
+    case 0x2F: return "ERASE_WRITE_FLASH_PAGE";
+    case 0x78: return "FLASH_CRC";
+    case 0x20: return "ERASE_APP_SECTION";
+    case 0x22: return "ERASE_APP_SECTION_PAGE";
+    case 0x24: return "WRITE_APP_SECTION_PAGE";
+    case 0x25: return "ERASE_WRITE_APP_SECTION_PAGE";
+    case 0x38: return "APP_SECTION_CRC";
+    case 0x68: return "ERASE_BOOT_SECTION";
+    case 0x2A: return "ERASE_BOOT_SECTION_PAGE";
+    case 0x2C: return "WRITE_BOOT_SECTION_PAGE";
+    case 0x2D: return "ERASE_WRITE_BOOT_SECTION_PAGE";
+    case 0x39: return "BOOT_SECTION_CRC";
+    case 0x03: return "READ_USERSIG_ROW";
+    case 0x18: return "ERASE_USERSIG_ROW";
+    case 0x1A: return "WRITE_USERSIG_ROW";
+    case 0x02: return "READ_CALIBRATION_ROW";
+    case 0x07: return "READ_FUSE";
+    case 0x4C: return "WRITE_FUSE";
+    case 0x08: return "WRITE_LOCK_BITS";
+    case 0x33: return "LOAD_EEPROM_PAGE_BUF";
+    case 0x36: return "ERASE_EEPROM_PAGE_BUF";
+    case 0x30: return "ERASE_EEPROM";
+    case 0x32: return "ERASE_EEPROM_PAGE";
+    case 0x34: return "WRITE_EEPROM_PAGE";
+    case 0x35: return "ERASE_WRITE_EEPROM_PAGE";
+    case 0x06: return "READ_EEPROM";
+  }
+  return "?";
+}
+
+static const char *ptr_mode_name[] = { "*ptr", "*ptr++", "ptr", "ptr++" };
+static const char *csreg_name[] = { "STATUS", "RESET", "CONTROL", "r3" };
+
+
+// Decoder state; each instruction is assembled from the records belonging to
+// it, then printed in one line together with its duration.
+struct decoder
+{
+  uint32_t ptr = 0;
+  uint32_t repeat = 1;
+  uint8_t nvm_cmd = 0;
+  uint32_t last_ts = 0;
+  unsigned errors = 0;
+  bool quiet = false;
+
+  const pdi_trace_rec_t *rec;
+  size_t n;
+  size_t i = 0;
+
+  decoder (const pdi_trace_rec_t *r, size_t cnt) : rec (r), n (cnt) {}
+
+  bool next (uint8_t kind, uint32_t &val)
+  {
+    if (i >= n || rec[i].kind != kind)
+      return false;
+    val = rec[i].val;
+    if (rec[i].flags)
+      ++errors;
+    ++i;
+    return true;
+  }
+
+  // gathers a little-endian field of sz bytes
+  bool field (uint8_t kind, unsigned sz, uint32_t &val)
+  {
+    val = 0;
+    for (unsigned b = 0; b < sz; ++b)
+    {
+      uint32_t v;
+      if (!next (kind, v))
+        return false;
+      val |= v << (8 * b);
+    }
+    return true;
+  }
+
+  // gathers count data bytes, keeping only the first few for display
+  bool data (uint8_t kind, uint32_t count, std::string &hex)
+  {
+    char tmp[4];
+    for (uint32_t b = 0; b < count; ++b)
+    {
+      uint32_t v;
+      if (!next (kind, v))
+        return false;
+      if (b < 8)
+      {
+        snprintf (tmp, sizeof (tmp), "%02x ", v);
+        hex += tmp;
+      }
+    }
+    if (count > 8)
+      hex += "...";
+    return true;
+  }
+
+  void emit (uint32_t start_ts, const std::string &what, const std::string &note)
+  {
+    uint32_t end_ts = i ? rec[i - 1].ts_us : start_ts;
+    if (!quiet)
+      printf ("%10u +%6uus %6uus  %-40s%s%s\n",
+        start_ts, start_ts - last_ts, end_ts - start_ts, what.c_str (),
+        note.empty () ? "" : "; ", note.c_str ());
+    last_ts = end_ts;
+  }
+
+  std::string annotate_sts (uint32_t addr, uint32_t val)
+  {
+    char tmp[64] = "";
+    if (addr == NVM_REG_CMD)
+    {
+      nvm_cmd = val;
+      snprintf (tmp, sizeof (tmp), "NVM CMD = %s", nvm_cmd_name (val));
+    }
+    else if (addr == NVM_REG_CTRLA && (val & 1))
+      snprintf (tmp, sizeof (tmp), "NVM CMDEX %s", nvm_cmd_name (nvm_cmd));
+    else if (nvm_cmd != 0 && addr >= 0x00800000 && addr < 0x01000000)
+      snprintf (tmp, sizeof (tmp), "trigger %s", nvm_cmd_name (nvm_cmd));
+    return tmp;
+  }
+
+  std::string annotate_stream (bool store, uint32_t addr, uint32_t len)
+  {
+    char tmp[80] = "";
+    if (!store && addr == NVM_REG_STATUS)
+      snprintf (tmp, sizeof (tmp), "NVM status poll");
+    else if (store && nvm_cmd == 0x23)
+      snprintf (tmp, sizeof (tmp), "page buffer load, %u bytes", len);
+    else if (store && len == 1)
+      snprintf (tmp, sizeof (tmp), "trigger %s @0x%08x",
+        nvm_cmd_name (nvm_cmd), addr);
+    else if (!store)
+      snprintf (tmp, sizeof (tmp), "%s %u bytes @0x%08x",
+        nvm_cmd_name (nvm_cmd), len, addr);
+    return tmp;
+  }
+
+  // decodes one instruction (or event), returns false at end of trace
+  bool step ()
+  {
+    if (i >= n)
+      return false;
+
+    const pdi_trace_rec_t &r = rec[i];
+    uint32_t start = r.ts_us;
+    char what[80] = "";
+    switch (r.kind)
+    {
+      case PDI_TRACE_OPEN:  ++i; emit (start, "-- open --", ""); return true;
+      case PDI_TRACE_CLOSE: ++i; emit (start, "-- close --", ""); return true;
+      case PDI_TRACE_BREAK:
+        ++i; repeat = 1; emit (start, "-- break --", ""); return true;
+      case PDI_TRACE_FAIL:
+      {
+        ++i; ++errors;
+        std::string note;
+        if (r.flags & PDI_TRACE_PARITY_ERR) note += "parity error ";
+        if (r.flags & PDI_TRACE_STOP_ERR) note += "stop bit error ";
+        if (r.flags & PDI_TRACE_TIMEOUT) note += "timeout ";
+        if (r.flags & PDI_TRACE_STOPPED) note += "stopped ";
+        emit (start, "-- sequence FAILED --", note);
+        repeat = 1;
+        return true;
+      }
+      case PDI_TRACE_RX:
+      {
+        ++i; ++errors;
+        snprintf (what, sizeof (what), "unexpected rx %02x", r.val);
+        emit (start, what, "");
+        return true;
+      }
+    }
+
+    uint32_t op = 0;
+    if (!next (PDI_TRACE_TX, op))
+    {
+      ++i; // unknown record kind, skip it
+      return true;
+    }
+    uint32_t rpt = repeat;
+    repeat = 1;
+    bool ok = true;
+    std::string hex, note;
+    switch (op & 0xE0)
+    {
+      case 0x00: // LDS
+      case 0x40: // STS
+      {
+        bool store = (op & 0xE0) == 0x40;
+        uint32_t addr = 0, val = 0;
+        ok = field (PDI_TRACE_TX, ((op >> 2) & 3) + 1, addr) &&
+          field (store ? PDI_TRACE_TX : PDI_TRACE_RX, (op & 3) + 1, val);
+        snprintf (what, sizeof (what), "%s [0x%08x] %s 0x%x",
+          store ? "STS" : "LDS", addr, store ? "<-" : "->", val);
+        if (store)
+          note = annotate_sts (addr, val);
+        break;
+      }
+      case 0x20: // LD
+      case 0x60: // ST
+      {
+        bool store = (op & 0xE0) == 0x60;
+        unsigned mode = (op >> 2) & 3;
+        unsigned sz = (op & 3) + 1;
+        if (mode >= 2) // the pointer register itself
+        {
+          uint32_t val;
+          ok = field (store ? PDI_TRACE_TX : PDI_TRACE_RX, sz, val);
+          if (store)
+            ptr = val;
+          snprintf (what, sizeof (what), "%s %s %s 0x%08x",
+            store ? "ST" : "LD", ptr_mode_name[mode], store ? "<-" : "->", val);
+          break;
+        }
+        uint32_t at = ptr;
+        ok = data (store ? PDI_TRACE_TX : PDI_TRACE_RX, rpt * sz, hex);
+        if (mode == 1)
+          ptr += rpt * sz;
+        if (rpt > 1)
+          snprintf (what, sizeof (what), "%s %s x%u %s",
+            store ? "ST" : "LD", ptr_mode_name[mode], rpt, hex.c_str ());
+        else
+          snprintf (what, sizeof (what), "%s %s %s",
+            store ? "ST" : "LD", ptr_mode_name[mode], hex.c_str ());
+        note = annotate_stream (store, at, rpt * sz);
+        break;
+      }
+      case 0x80: // LDCS
+      case 0xC0: // STCS
+      {
+        bool store = (op & 0xE0) == 0xC0;
+        uint32_t val;
+        ok = field (store ? PDI_TRACE_TX : PDI_TRACE_RX, 1, val);
+        snprintf (what, sizeof (what), "%s %s %s 0x%02x",
+          store ? "STCS" : "LDCS", csreg_name[op & 3], store ? "<-" : "->", val);
+        break;
+      }
+      case 0xA0: // REPEAT
+      {
+        uint32_t val;
+        ok = field (PDI_TRACE_TX, (op & 3) + 1, val);
+        repeat = val + 1;
+        snprintf (what, sizeof (what), "REPEAT %u", val);
+        break;
+      }
+      case 0xE0: // KEY
+      {
+        ok = data (PDI_TRACE_TX, 8, hex);
+        snprintf (what, sizeof (what), "KEY %s", hex.c_str ());
+        note = "enable NVM";
+        break;
+      }
+    }
+    if (!ok)
+      note = "truncated instruction" + (note.empty () ? "" : ", " + note);
+    emit (start, what, note);
+    return true;
+  }
+};
+
+
+static bool write_vcd (const char *fname, const std::vector<pdi_trace_rec_t> &recs)
+{
+  FILE *f = fopen (fname, "w");
+  if (!f)
+    return false;
+
+  fprintf (f,
+    "$timescale 1us $end\n"
+    "$scope module pdi $end\n"
+    "$var wire 8 d byte $end\n"
+    "$var wire 1 t tx $end\n"
+    "$var wire 1 r rx $end\n"
+    "$var wire 1 e error $end\n"
+    "$var wire 1 b break $end\n"
+    "$upscope $end\n"
+    "$enddefinitions $end\n"
+    "#0\n$dumpvars\nbxxxxxxxx d\n0t\n0r\n0e\n0b\n$end\n");
+
+  for (auto &r : recs)
+  {
+    fprintf (f, "#%u\n", r.ts_us);
+    bool is_tx = r.kind == PDI_TRACE_TX;
+    bool is_rx = r.kind == PDI_TRACE_RX;
+    if (is_tx || is_rx)
+    {
+      fprintf (f, "b");
+      for (int b = 7; b >= 0; --b)
+        fputc ((r.val >> b) & 1 ? '1' : '0', f);
+      fprintf (f, " d\n");
+    }
+    fprintf (f, "%dt\n%dr\n%de\n%db\n", is_tx, is_rx,
+      r.flags != 0 || r.kind == PDI_TRACE_FAIL, r.kind == PDI_TRACE_BREAK);
+  }
+
+  return fclose (f) == 0;
+}
+
+
+static void syntax (const char *name)
+{
+  fprintf (stderr,
+    "syntax: %s [-h] [-q] [-v vcdfile] tracefile\n\n"
+    "  -q             don't print the decoded instruction listing\n"
+    "  -v vcdfile     also export the trace as a VCD file\n"
+    "  -h             show this help\n"
+    "\n"
+    , name);
+  exit (-1);
+}
+
+
+int main (int argc, char *argv[])
+{
+  bool quiet = false;
+  const char *vcd = 0;
+
+  int opt;
+  while ((opt = getopt (argc, argv, "hqv:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'q': quiet = true; break;
+      case 'v': vcd = optarg; break;
+      case 'h': // fall through
+      default: syntax (argv[0]); break;
+    }
+  }
+  if (optind != argc - 1)
+    syntax (argv[0]);
+
+  FILE *f = fopen (argv[optind], "rb");
+  if (!f)
+  {
+    fprintf (stderr, "error: unable to open %s\n", argv[optind]);
+    return 1;
+  }
+
+  pdi_trace_hdr_t hdr;
+  if (fread (&hdr, sizeof (hdr), 1, f) != 1 ||
+      memcmp (hdr.magic, PDI_TRACE_MAGIC, sizeof (hdr.magic)) != 0 ||
+      hdr.version != PDI_TRACE_VERSION)
+  {
+    fprintf (stderr, "error: not a PDI trace file\n");
+    return 2;
+  }
+
+  std::vector<pdi_trace_rec_t> recs (hdr.count);
+  if (fread (recs.data (), sizeof (pdi_trace_rec_t), hdr.count, f) != hdr.count)
+  {
+    fprintf (stderr, "error: trace file truncated\n");
+    return 2;
+  }
+  fclose (f);
+
+  printf ("%u records, pdi delay %uus", hdr.count, hdr.delay_us);
+  if (hdr.dropped)
+    printf (", %u oldest records lost to wrap-around (decode may start "
+      "mid-instruction)", hdr.dropped);
+  printf ("\n");
+
+  decoder dec (recs.data (), recs.size ());
+  dec.quiet = quiet;
+  if (!quiet)
+    printf ("%10s %8s %8s  %s\n", "time", "gap", "dur", "instruction");
+  while (dec.step ())
+    ;
+
+  unsigned tx = 0, rx = 0;
+  for (auto &r : recs)
+  {
+    tx += r.kind == PDI_TRACE_TX;
+    rx += r.kind == PDI_TRACE_RX;
+  }
+  uint32_t span = recs.empty () ? 0 : recs.back ().ts_us - recs.front ().ts_us;
+  printf ("%u bytes out, %u bytes in, %u errors, %uus total\n",
+    tx, rx, dec.errors, span);
+
+  if (vcd && !write_vcd (vcd, recs))
+  {
+    fprintf (stderr, "error: failed to write %s\n", vcd);
+    return 3;
+  }
+
+  return 0;
+}
@@ -0,0 +1,130 @@
+/* Copyright (C) 2015 DiUS Computing Pty. Ltd.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#include "plan.h"
+extern "C" {
+#include "nvm.h"
+}
+
+// command bytes per page operation (busy polls, NVM CMD, pointer, repeat)
+#define PAGE_CMD_BYTES           50
+
+
+// nominal PDI link model: each frame is 12 bits, each bit costs two clock
+// delays plus the gpio access overhead
+static uint64_t xfer_us (uint32_t bytes, uint32_t delay_us)
+{
+  uint64_t bit_ns = 2000ull * delay_us + PDI_BIT_OVERHEAD_NS;
+  return bytes * PDI_FRAME_BITS * bit_ns / 1000;
+}
+
+
+flash_region_t plan_region (uint32_t base)
+{
+  flash_region_t region = { base, 0, false };
+  if (base == 0x800000)
+    region.size = NVM_APP_SECTION_SIZE;
+  if (base == 0x840000)
+  {
+    region.size = NVM_BOOT_SECTION_SIZE;
+    region.boot = true;
+  }
+  return region;
+}
+
+
+bool page_is_blank (const char *data, size_t len)
+{
+  for (size_t i = 0; i < len; ++i)
+    if ((uint8_t)data[i] != 0xff)
+      return false;
+  return true;
+}
+
+
+uint32_t plan_blank_crc (uint32_t size)
+{
+  // CRC-32 (IEEE 802.3), as used by the XMEGA NVM controller; only the
+  // lower 24 bits are available through NVM DATA0..2
+  uint32_t crc = 0xffffffff;
+  while (size--)
+  {
+    crc ^= 0xff;
+    for (int b = 0; b < 8; ++b)
+      crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+  }
+  return ~crc & 0xffffff;
+}
+
+
+plan_t plan_programming (
+  const page_list_t &pages, const flash_region_t &region,
+  bool chip_erased, bool may_erase_section, uint32_t delay_us)
+{
+  plan_t plan;
+  plan.blank_check = false;
+  plan.write_pages = plan.blank_pages = 0;
+  for (auto &p : pages)
+  {
+    if (page_is_blank (p.data, IMAGE_PAGE_SIZE))
+      ++plan.blank_pages;
+    else
+      ++plan.write_pages;
+  }
+
+  uint64_t page_xfer = xfer_us (PAGE_CMD_BYTES + 512, delay_us);
+  uint64_t cmd_xfer = xfer_us (PAGE_CMD_BYTES, delay_us);
+  uint64_t write_only = plan.write_pages * (page_xfer + NVM_PAGE_WRITE_US);
+  uint64_t erase_write =
+    plan.write_pages * (page_xfer + NVM_PAGE_ERASE_WRITE_US) +
+    plan.blank_pages * (cmd_xfer + NVM_PAGE_ERASE_US);
+
+  if (chip_erased)
+  {
+    plan.kind = PLAN_WRITE_ONLY;
+    plan.est_us = plan.est_blank_us = write_only;
+    return plan;
+  }
+
+  plan.kind = PLAN_ERASE_WRITE;
+  plan.est_us = plan.est_blank_us = erase_write;
+
+  // a blank check costs a full-section CRC and only pays off on blank
+  // parts; only bother when a hit would save several times its cost
+  uint64_t crc = region.size / NVM_CRC_BYTES_PER_US;
+  if (region.size && erase_write > write_only + 4 * crc)
+  {
+    plan.blank_check = true;
+    plan.est_us = crc + erase_write;
+    plan.est_blank_us = crc + write_only;
+  }
+
+  // a section erase is only worth it if it beats erasing page by page,
+  // which for a small image on a large section it doesn't
+  uint64_t section_erase = NVM_SECTION_ERASE_US + write_only;
+  if (may_erase_section && region.size && section_erase < plan.est_us)
+  {
+    plan.kind = PLAN_SECTION_ERASE_WRITE;
+    plan.blank_check = false;
+    plan.est_us = plan.est_blank_us = section_erase;
+  }
+
+  return plan;
+}
+
+
+const char *plan_name (plan_kind_t kind)
+{
+  switch (kind)
+  {
+    case PLAN_ERASE_WRITE:         return "page-erase+write";
+    case PLAN_WRITE_ONLY:          return "write-only";
+    case PLAN_SECTION_ERASE_WRITE: return "section-erase+write-only";
+  }
+  return "unknown";
+}
@@ -0,0 +1,59 @@
+/* Copyright (C) 2015 DiUS Computing Pty. Ltd.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#ifndef _PLAN_H_
+#define _PLAN_H_
+
+#include "image.h"
+
+// The flash section being programmed. A size of 0 means the section layout
+// is unknown (e.g. custom -a base address), which rules out section erase
+// and blank checking.
+struct flash_region_t
+{
+  uint32_t base;
+  uint32_t size;
+  bool boot;
+};
+
+// the region at a flash base; the layout is only known for the x256 defaults
+flash_region_t plan_region (uint32_t base);
+
+enum plan_kind_t
+{
+  PLAN_ERASE_WRITE,         // per-page erase+write, blank pages erase only
+  PLAN_WRITE_ONLY,          // target known to be blank, write non-blank pages
+  PLAN_SECTION_ERASE_WRITE  // erase section, then write non-blank pages
+};
+
+struct plan_t
+{
+  plan_kind_t kind;
+  bool blank_check;  // run an on-chip CRC first; if it shows the section is
+                     // blank, PLAN_ERASE_WRITE gets downgraded to write-only
+  unsigned write_pages;
+  unsigned blank_pages;
+  uint32_t est_us;
+  uint32_t est_blank_us; // estimate if the blank check succeeds
+};
+
+// picks the cheapest way of getting pages onto the target, given whether a
+// chip erase was already done and whether the user allows erasing the
+// whole target section
+plan_t plan_programming (
+  const page_list_t &pages, const flash_region_t &region,
+  bool chip_erased, bool may_erase_section, uint32_t delay_us);
+
+// the checksum an all-0xFF section of the given size is expected to produce
+uint32_t plan_blank_crc (uint32_t size);
+
+bool page_is_blank (const char *data, size_t len);
+
+const char *plan_name (plan_kind_t kind);
+
+#endif
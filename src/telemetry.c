@@ -0,0 +1,196 @@
+/* Copyright (C) 2015 DiUS Computing Pty. Ltd.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#define _POSIX_C_SOURCE 200112L
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
+
+#include "telemetry.h"
+#include "errinfo.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <string.h>
+
+
+static inline void tm_begin (telemetry_t *tm)
+{
+  ++tm->seq;
+  __sync_synchronize ();
+}
+
+
+static inline void tm_end (telemetry_t *tm)
+{
+  __sync_synchronize ();
+  ++tm->seq;
+}
+
+
+// --- Writer side -------------------------------------------------
+
+telemetry_t *telemetry_init (const char *shm_name)
+{
+  telemetry_t *tm;
+  if (!shm_name)
+  {
+    // mapped rather than malloc'd, so all blocks can be released alike
+    void *p = mmap (0, sizeof (telemetry_t), PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+      return_errinfo (0, "failed to allocate telemetry block");
+    tm = (telemetry_t *)p;
+  }
+  else
+  {
+    int fd = shm_open (shm_name, O_CREAT | O_RDWR, 0644);
+    if (fd < 0)
+      return_errinfo (0, "failed to open telemetry shm");
+    if (ftruncate (fd, sizeof (telemetry_t)) != 0)
+    {
+      close (fd);
+      return_errinfo (0, "failed to size telemetry shm");
+    }
+    void *p = mmap (
+      0, sizeof (telemetry_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close (fd);
+    if (p == MAP_FAILED)
+      return_errinfo (0, "failed to map telemetry shm");
+    tm = (telemetry_t *)p;
+  }
+
+  // a reused shm object keeps the seq of its last writer, which is left odd
+  // if that one died mid-update; even it up, or readers never see it settle
+  tm->seq += tm->seq & 1;
+  __sync_synchronize ();
+  tm_begin (tm);
+  tm->magic = TELEMETRY_MAGIC;
+  tm->phase = TM_IDLE;
+  tm->page_idx = tm->page_count = 0;
+  tm->bytes = 0;
+  tm->retries = 0;
+  tm->delay_us = 0;
+  tm_end (tm);
+  return tm;
+}
+
+
+void telemetry_close (telemetry_t *tm)
+{
+  if (!tm)
+    return;
+  // the shm object itself is left in place, so a late reader still gets to
+  // see the final TM_DONE/TM_FAILED state; it's theirs to shm_unlink()
+  munmap (tm, sizeof (telemetry_t));
+}
+
+
+void telemetry_set_phase (telemetry_t *tm, telemetry_phase_t phase)
+{
+  if (!tm)
+    return;
+  tm_begin (tm);
+  tm->phase = phase;
+  tm_end (tm);
+}
+
+
+void telemetry_set_page (telemetry_t *tm, uint32_t idx, uint32_t count)
+{
+  if (!tm)
+    return;
+  tm_begin (tm);
+  tm->page_idx = idx;
+  tm->page_count = count;
+  tm_end (tm);
+}
+
+
+void telemetry_add_bytes (telemetry_t *tm, uint32_t n)
+{
+  if (!tm)
+    return;
+  tm_begin (tm);
+  tm->bytes += n;
+  tm_end (tm);
+}
+
+
+void telemetry_add_retry (telemetry_t *tm)
+{
+  if (!tm)
+    return;
+  tm_begin (tm);
+  ++tm->retries;
+  tm_end (tm);
+}
+
+
+void telemetry_set_delay (telemetry_t *tm, uint32_t delay_us)
+{
+  if (!tm)
+    return;
+  tm_begin (tm);
+  tm->delay_us = delay_us;
+  tm_end (tm);
+}
+
+
+// --- Reader side -------------------------------------------------
+
+const telemetry_t *telemetry_attach (const char *shm_name)
+{
+  int fd = shm_open (shm_name, O_RDONLY, 0);
+  if (fd < 0)
+    return_errinfo (0, "failed to open telemetry shm");
+  void *p = mmap (0, sizeof (telemetry_t), PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (p == MAP_FAILED)
+    return_errinfo (0, "failed to map telemetry shm");
+
+  const telemetry_t *t = (const telemetry_t *)p;
+  if (t->magic != TELEMETRY_MAGIC)
+  {
+    munmap (p, sizeof (telemetry_t));
+    return_errinfo (0, "bad telemetry shm magic");
+  }
+  return t;
+}
+
+
+void telemetry_snapshot (const telemetry_t *t, telemetry_snapshot_t *out)
+{
+  uint32_t seq;
+  do
+  {
+    while ((seq = t->seq) & 1)
+      sched_yield (); // writer mid-update, it won't be long
+
+    __sync_synchronize ();
+    out->phase = t->phase;
+    out->page_idx = t->page_idx;
+    out->page_count = t->page_count;
+    out->bytes = t->bytes;
+    out->retries = t->retries;
+    out->delay_us = t->delay_us;
+    __sync_synchronize ();
+  } while (t->seq != seq);
+
+  out->seq = seq;
+}
+
+
+const char *telemetry_phase_name (uint32_t phase)
+{
+  static const char *names[] = {
+    "idle", "open", "erase", "program", "read", "close", "done", "failed"
+  };
+  return (phase < sizeof (names) / sizeof (names[0])) ?
+    names[phase] : "unknown";
+}
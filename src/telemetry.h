@@ -0,0 +1,88 @@
+/* Copyright (C) 2015 DiUS Computing Pty. Ltd.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#ifndef _TELEMETRY_H_
+#define _TELEMETRY_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TELEMETRY_MAGIC   0x544d5031 // "TMP1"
+
+typedef enum {
+  TM_IDLE,
+  TM_OPEN,
+  TM_ERASE,
+  TM_PROGRAM,
+  TM_READ,
+  TM_CLOSE,
+  TM_DONE,
+  TM_FAILED
+} telemetry_phase_t;
+
+// The shared block. It is only ever written by the process talking PDI, using
+// plain stores bracketed by the seq counter (odd while an update is in
+// progress), so the RT side never blocks or makes a syscall on account of it.
+// Readers must go through telemetry_snapshot() to get a consistent view.
+typedef struct telemetry
+{
+  uint32_t magic;
+  volatile uint32_t seq;
+
+  volatile uint32_t phase;
+  volatile uint32_t page_idx;
+  volatile uint32_t page_count;
+  volatile uint64_t bytes;    // bytes clocked over PDI, both directions
+  volatile uint32_t retries;  // status re-polls while waiting on the target
+  volatile uint32_t delay_us; // current PDI clock delay, i.e. link speed
+} telemetry_t;
+
+typedef struct
+{
+  uint32_t seq;
+  uint32_t phase;
+  uint32_t page_idx;
+  uint32_t page_count;
+  uint64_t bytes;
+  uint32_t retries;
+  uint32_t delay_us;
+} telemetry_snapshot_t;
+
+
+// --- Writer side (the PDI process) ---------------------------------
+
+// shm_name may be null, in which case a process-local block is allocated;
+// call before pdi_open(), as the mapping should not be created while RT
+telemetry_t *telemetry_init (const char *shm_name);
+
+void telemetry_close (telemetry_t *tm);
+
+// all of these are no-ops on a null block
+void telemetry_set_phase (telemetry_t *tm, telemetry_phase_t phase);
+void telemetry_set_page (telemetry_t *tm, uint32_t idx, uint32_t count);
+void telemetry_add_bytes (telemetry_t *tm, uint32_t n);
+void telemetry_add_retry (telemetry_t *tm);
+void telemetry_set_delay (telemetry_t *tm, uint32_t delay_us);
+
+
+// --- Reader side (supervisor thread or external process) -----------
+
+const telemetry_t *telemetry_attach (const char *shm_name);
+
+void telemetry_snapshot (const telemetry_t *tm, telemetry_snapshot_t *out);
+
+const char *telemetry_phase_name (uint32_t phase);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,328 @@
+/* Copyright (C) 2015 DiUS Computing Pty. Ltd.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#include "watch.h"
+#include "errinfo.h"
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// a new burst costs a pointer load, a repeat, an LD and two direction
+// switches; reading a gap of up to this many bytes is cheaper
+#define WATCH_MERGE_GAP 8
+
+#define WATCH_MAX_SIZE  256
+#define WATCH_BUF_SIZE  (1024*1024)
+
+
+bool parse_watch_list (const char *spec, std::vector<watch_entry_t> &entries)
+{
+  const char *p = spec;
+  while (*p)
+  {
+    char *end;
+    watch_entry_t e;
+    e.addr = strtoul (p, &end, 0);
+    if (end == p || *end != ':')
+      return_errinfo (false, "bad watch list, expected addr:size");
+    p = end + 1;
+    e.size = strtoul (p, &end, 0);
+    if (end == p || (*end && *end != ','))
+      return_errinfo (false, "bad watch list, expected addr:size");
+    if (e.size < 1 || e.size > WATCH_MAX_SIZE)
+      return_errinfo (false, "watch sizes must be 1..256 bytes");
+    if (e.addr + e.size > 0x1000000)
+      return_errinfo (false, "watch address outside the data space");
+    entries.push_back (e);
+    p = *end ? end + 1 : end;
+  }
+  if (entries.empty ())
+    return_errinfo (false, "empty watch list");
+  return true;
+}
+
+
+watch_plan_t plan_watch (const std::vector<watch_entry_t> &entries)
+{
+  watch_plan_t plan;
+  plan.entries = entries;
+  plan.offs.resize (entries.size ());
+  plan.burst_bytes = 0;
+  plan.sample_bytes = 0;
+
+  std::vector<size_t> order (entries.size ());
+  for (size_t i = 0; i < order.size (); ++i)
+    order[i] = i;
+  std::sort (order.begin (), order.end (),
+    [&entries] (size_t a, size_t b)
+    { return entries[a].addr < entries[b].addr; });
+
+  std::vector<size_t> burst_of (entries.size ());
+  for (size_t i : order)
+  {
+    const watch_entry_t &e = entries[i];
+    plan.sample_bytes += e.size;
+    if (plan.bursts.empty () ||
+        e.addr > plan.bursts.back ().addr + plan.bursts.back ().len +
+          WATCH_MERGE_GAP)
+    {
+      watch_burst_t b = { e.addr, 0 };
+      plan.bursts.push_back (b);
+    }
+    watch_burst_t &b = plan.bursts.back ();
+    uint32_t end = e.addr + e.size;
+    if (end > b.addr + b.len)
+      b.len = end - b.addr;
+    burst_of[i] = plan.bursts.size () - 1;
+  }
+
+  std::vector<uint32_t> burst_offs;
+  for (auto &b : plan.bursts)
+  {
+    burst_offs.push_back (plan.burst_bytes);
+    plan.burst_bytes += b.len;
+  }
+  for (size_t i = 0; i < entries.size (); ++i)
+  {
+    const watch_burst_t &b = plan.bursts[burst_of[i]];
+    plan.offs[i] = burst_offs[burst_of[i]] + entries[i].addr - b.addr;
+  }
+
+  return plan;
+}
+
+
+// Collects output in a preallocated buffer. It is only written out once
+// full, with the keep-alive holding the link meanwhile, so the sampling
+// loop never waits on i/o.
+struct watch_writer
+{
+  pdi_ctx_t *ctx;
+  FILE *out;
+  std::vector<char> buf;
+  size_t len;
+
+  watch_writer (pdi_ctx_t *c, FILE *f, size_t cap)
+    : ctx (c), out (f), buf (cap), len (0) {}
+
+  // returns room for at least n bytes, flushing first if need be
+  char *reserve (size_t n)
+  {
+    if (len + n > buf.size () && !flush ())
+      return 0;
+    return &buf[len];
+  }
+
+  void commit (size_t n) { len += n; }
+
+  bool flush ()
+  {
+    if (!len)
+      return true;
+    if (!pdi_keepalive_begin (ctx))
+      return_errinfo (false, "no keep-alive to write watch output");
+    bool ok = fwrite (&buf[0], 1, len, out) == len && fflush (out) == 0;
+    pdi_keepalive_end (ctx);
+    len = 0;
+    if (!ok)
+      return_errinfo (false, "failed to write watch output");
+    return true;
+  }
+};
+
+
+// a link of the sample sequence, with room for the outcome; the done
+// callback is handed back the head link, so that's where it goes
+struct sample_seq_t
+{
+  pdi_sequence_t seq;
+  bool ok;
+};
+
+static void sample_done (pdi_ctx_t *ctx, bool success, pdi_sequence_t *seq)
+{
+  (void)ctx;
+  reinterpret_cast<sample_seq_t *> (seq)->ok = success;
+}
+
+
+static char *put_hex (char *p, const uint8_t *v, uint32_t n)
+{
+  static const char digits[] = "0123456789abcdef";
+  // multi-byte values are little endian on the target
+  for (uint32_t i = n; i--; )
+  {
+    *p++ = digits[v[i] >> 4];
+    *p++ = digits[v[i] & 15];
+  }
+  return p;
+}
+
+
+static uint64_t now_us ()
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+bool run_watch (
+  pdi_ctx_t *ctx, const watch_plan_t &plan, FILE *out, bool binary,
+  uint64_t count, volatile sig_atomic_t *stopping, watch_result_t *res)
+{
+  // one out/in transfer pair per burst, chained into a single sequence
+  size_t nb = plan.bursts.size ();
+  std::vector<char> data (plan.burst_bytes);
+  std::vector<char> cmds (nb * 11);
+  std::vector<pdi_transfer_t> xfers (nb * 2);
+  std::vector<sample_seq_t> seq (nb * 2);
+  uint32_t offs = 0;
+  for (size_t i = 0; i < nb; ++i)
+  {
+    const watch_burst_t &b = plan.bursts[i];
+    uint32_t addr = PDI_DATA_SPACE_BASE + b.addr;
+    uint32_t rpt = b.len - 1;
+    char *c = &cmds[i * 11];
+    uint32_t n = 0;
+    c[n++] = ST | PTR | SZ_4;
+    c[n++] = (addr      ) & 0xff;
+    c[n++] = (addr >>  8) & 0xff;
+    c[n++] = (addr >> 16) & 0xff;
+    c[n++] = (addr >> 24) & 0xff;
+    if (rpt > 0xffff)
+    {
+      c[n++] = REPEAT | SZ_4;
+      c[n++] = (rpt      ) & 0xff;
+      c[n++] = (rpt >>  8) & 0xff;
+      c[n++] = (rpt >> 16) & 0xff;
+      c[n++] = (rpt >> 24) & 0xff;
+    }
+    else if (rpt > 0xff)
+    {
+      c[n++] = REPEAT | SZ_2;
+      c[n++] = (rpt     ) & 0xff;
+      c[n++] = (rpt >> 8) & 0xff;
+    }
+    else if (rpt)
+    {
+      c[n++] = REPEAT | SZ_1;
+      c[n++] = rpt;
+    }
+    c[n++] = LD | xPTRpp | SZ_1;
+
+    xfers[i * 2].len = n;
+    xfers[i * 2].buf = c;
+    xfers[i * 2].dir = PDI_OUT;
+    xfers[i * 2 + 1].len = b.len;
+    xfers[i * 2 + 1].buf = &data[offs];
+    xfers[i * 2 + 1].dir = PDI_IN;
+    offs += b.len;
+  }
+  for (size_t i = 0; i < seq.size (); ++i)
+  {
+    seq[i].seq.xfer = &xfers[i];
+    seq[i].seq.next = (i + 1 < seq.size ()) ? &seq[i + 1].seq : 0;
+  }
+
+  // an unclocked target drops out of PDI mode long before a write returns,
+  // so don't even start without a core for the keep-alive
+  if (!pdi_keepalive_begin (ctx))
+    return_errinfo (false, "watching needs a spare core for the keep-alive");
+  pdi_keepalive_end (ctx);
+
+  // room for the longest text line, or binary record
+  size_t max_rec = 24 + plan.entries.size () * (14 + 2 * WATCH_MAX_SIZE);
+  watch_writer w (ctx, out, std::max ((size_t)WATCH_BUF_SIZE, 2 * max_rec));
+
+  if (binary)
+  {
+    watch_hdr_t hdr;
+    memcpy (hdr.magic, WATCH_MAGIC, sizeof (hdr.magic));
+    hdr.version = WATCH_VERSION;
+    hdr.nentries = plan.entries.size ();
+    char *p = w.reserve (sizeof (hdr));
+    memcpy (p, &hdr, sizeof (hdr));
+    w.commit (sizeof (hdr));
+    for (auto &e : plan.entries)
+    {
+      p = w.reserve (sizeof (e));
+      memcpy (p, &e, sizeof (e));
+      w.commit (sizeof (e));
+    }
+  }
+
+  res->samples = 0;
+  res->secs = 0;
+  uint64_t t0 = 0;
+  bool ok = true;
+  while (!*stopping && (!count || res->samples < count))
+  {
+    if (!pdi_set_sequence (ctx, &seq[0].seq, sample_done))
+    {
+      set_errinfo ("failed to start watch sample", -1);
+      ok = false;
+      break;
+    }
+    pdi_run (ctx);
+    if (!seq[0].ok)
+    {
+      if (!*stopping) // interrupting a sample is the normal way out
+      {
+        set_errinfo ("failed to read watch sample", -1);
+        ok = false;
+      }
+      break;
+    }
+
+    uint64_t t = now_us ();
+    if (!res->samples++)
+      t0 = t;
+    t -= t0;
+
+    char *p = w.reserve (max_rec);
+    if (!p)
+    {
+      ok = false;
+      break;
+    }
+    char *start = p;
+    if (binary)
+    {
+      memcpy (p, &t, sizeof (t));
+      p += sizeof (t);
+      for (size_t i = 0; i < plan.entries.size (); ++i)
+      {
+        memcpy (p, &data[plan.offs[i]], plan.entries[i].size);
+        p += plan.entries[i].size;
+      }
+    }
+    else
+    {
+      p += sprintf (p, "%llu", (unsigned long long)t);
+      for (size_t i = 0; i < plan.entries.size (); ++i)
+      {
+        p += sprintf (p, " %04x=", plan.entries[i].addr);
+        p = put_hex (p,
+          (const uint8_t *)&data[plan.offs[i]], plan.entries[i].size);
+      }
+      *p++ = '\n';
+    }
+    w.commit (p - start);
+  }
+  if (res->samples > 1)
+    res->secs = (now_us () - t0) / 1e6;
+
+  // the sequences moved the pointer behind the NVM layer's back
+  pdi_shadow_invalidate (ctx);
+
+  if (!w.flush ())
+    ok = false;
+  return ok;
+}
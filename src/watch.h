@@ -0,0 +1,75 @@
+/* Copyright (C) 2015 DiUS Computing Pty. Ltd.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#ifndef _WATCH_H_
+#define _WATCH_H_
+
+extern "C" {
+#include "pdi.h"
+}
+#include <signal.h>
+#include <stdio.h>
+#include <vector>
+
+// Binary watch output: the header, then nentries watch_entry_t, then one
+// record per sample: a uint64_t timestamp (us since the first sample)
+// followed by the bytes of each entry, in list order. Little endian.
+#define WATCH_MAGIC   "PDIWATCH"
+#define WATCH_VERSION 1
+
+struct watch_hdr_t
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t nentries;
+};
+
+// an address in the CPU's data space, and the number of bytes there
+struct watch_entry_t
+{
+  uint32_t addr;
+  uint32_t size;
+};
+
+// a run of the data space read with a single REPEAT + LD *ptr++
+struct watch_burst_t
+{
+  uint32_t addr;
+  uint32_t len;
+};
+
+struct watch_plan_t
+{
+  std::vector<watch_entry_t> entries;
+  std::vector<watch_burst_t> bursts;
+  std::vector<uint32_t> offs; // of each entry, within the bursts' data
+  uint32_t burst_bytes;
+  uint32_t sample_bytes;
+};
+
+struct watch_result_t
+{
+  uint64_t samples;
+  double secs;
+};
+
+// parses "addr:size[,addr:size]..."
+bool parse_watch_list (const char *spec, std::vector<watch_entry_t> &entries);
+
+// groups entries into bursts, merging neighbours where reading the gap
+// between them is cheaper than another pointer load
+watch_plan_t plan_watch (const std::vector<watch_entry_t> &entries);
+
+// samples until count samples are taken (0: no limit) or *stopping is set;
+// binary output goes to out as described above, otherwise a line of text
+// per sample
+bool run_watch (
+  pdi_ctx_t *ctx, const watch_plan_t &plan, FILE *out, bool binary,
+  uint64_t count, volatile sig_atomic_t *stopping, watch_result_t *res);
+
+#endif
@@ -0,0 +1,740 @@
+/* Copyright (C) 2015 DiUS Computing Pty. Ltd.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#include "xmegapdi.h"
+extern "C" {
+#include "nvm.h"
+}
+#include "errinfo.h"
+#include "manifest.h"
+#include "telemetry.h"
+#include <string.h>
+
+#define PROBE_TIMEOUT_TICKS 2000 // a present target answers much sooner
+
+// unchanged pages to CRC before trusting a device manifest
+#define SPOT_CHECK_PAGES    4
+
+// manifest room reserved up front: all of an XMEGA256's flash
+#define MANIFEST_RESERVE_PAGES \
+  ((NVM_APP_SECTION_SIZE + NVM_BOOT_SECTION_SIZE) / IMAGE_PAGE_SIZE)
+
+struct xpdi_session
+{
+  xpdi_config_t cfg;
+  pdi_ctx_t *ctx;
+  telemetry_t *tm;
+  flash_region_t region;
+
+  bool is_open;
+  bool failed;      // an operation failed since open
+  bool chip_erased; // ...and whether a chip erase was done
+
+  std::string manifest_dir; // empty without manifests
+  manifest_t manifest;
+  bool device_known;
+  bool au_checked;  // whether range_crc has been found out yet
+  bool range_crc;   // the part has the flash range CRC (an XMEGA AU)
+  bool trusted;
+  bool stale;
+  uint32_t skipped;
+
+  char usersig[NVM_USERSIG_SIZE];
+  char page_buf[IMAGE_PAGE_SIZE];
+  char burst_buf[XPDI_CHECK_BURST_PAGES * IMAGE_PAGE_SIZE];
+};
+
+struct xpdi_image
+{
+  page_map_512_t storage;
+  mapped_image_t img;
+  page_list_t pages;
+  std::vector<image_page_t> entries; // for ihex pages
+};
+
+
+static int track (xpdi_session_t *s, int ret)
+{
+  if (ret)
+    s->failed = true;
+  return ret;
+}
+
+
+static bool check_open (xpdi_session_t *s)
+{
+  if (!s->is_open)
+    return_errinfo (false, "session not open");
+  return true;
+}
+
+
+void xpdi_default_config (xpdi_config_t *cfg)
+{
+  memset (cfg, 0, sizeof (*cfg));
+  cfg->clk_pin = 24;  // j8.18
+  cfg->data_pin = 21; // j8.40
+  cfg->flash_base = 0x800000;
+}
+
+
+int xpdi_new (const xpdi_config_t *cfg, xpdi_session_t **ps)
+{
+  xpdi_session_t *s = new xpdi_session_t ();
+  s->cfg = *cfg;
+  s->cfg.telemetry_shm = 0; // only needed here
+  s->cfg.manifest_dir = 0;
+  if (cfg->manifest_dir)
+  {
+    s->manifest_dir = cfg->manifest_dir;
+    manifest_reserve (s->manifest, MANIFEST_RESERVE_PAGES);
+  }
+  s->region = plan_region (cfg->flash_base);
+
+  s->tm = telemetry_init (cfg->telemetry_shm);
+  if (!s->tm)
+  {
+    delete s;
+    return XPDI_ERR_TELEMETRY;
+  }
+  s->ctx = cfg->dry_run ?
+    pdi_init_dry_run (cfg->delay_us) :
+    pdi_init (cfg->clk_pin, cfg->data_pin, cfg->delay_us);
+  if (!s->ctx)
+  {
+    telemetry_close (s->tm);
+    delete s;
+    return XPDI_ERR_INIT;
+  }
+  pdi_set_telemetry (s->ctx, s->tm);
+  pdi_set_run_target (s->ctx, cfg->run_target);
+  if (cfg->trace_records && !pdi_trace_enable (s->ctx, cfg->trace_records))
+  {
+    xpdi_free (s);
+    return_errinfo (XPDI_ERR_TRACE, "failed to allocate trace buffer");
+  }
+
+  *ps = s;
+  return XPDI_OK;
+}
+
+
+void xpdi_free (xpdi_session_t *s)
+{
+  if (!s)
+    return;
+  xpdi_close (s);
+  telemetry_close (s->tm);
+  pdi_free (s->ctx);
+  delete s;
+}
+
+
+pdi_ctx_t *xpdi_ctx (xpdi_session_t *s)
+{
+  return s->ctx;
+}
+
+
+// The spot check needs the flash range CRC, and the blank check a section
+// CRC of the same kind; only XMEGA AU parts have those. They share their
+// signatures with the plain A parts, so rather than going by those, see
+// whether the range CRC gets the section's first page right. Done once per
+// attachment, when first needed.
+static int detect_range_crc (xpdi_session_t *s)
+{
+  if (s->au_checked)
+    return XPDI_OK;
+  uint32_t addr = s->region.base, crc;
+  if (!nvm_read (s->ctx, addr, s->page_buf, IMAGE_PAGE_SIZE))
+    return_errinfoloc (XPDI_ERR_READ, "failed to read page at address", 0);
+  // a dry run only gets to count the traffic
+  s->range_crc = s->cfg.dry_run ||
+    (nvm_range_crc (s->ctx, addr, addr + IMAGE_PAGE_SIZE - 1, &crc) &&
+     crc == (page_crc (s->page_buf, IMAGE_PAGE_SIZE) & 0xffffff));
+  s->au_checked = true;
+  return XPDI_OK;
+}
+
+
+// finds out which device this is and what's known to be on it
+static int load_device_manifest (xpdi_session_t *s)
+{
+  char prodsig[NVM_PRODSIG_ID_SIZE], id[MANIFEST_ID_LEN + 1];
+  if (!nvm_read (s->ctx, NVM_PRODSIG_ID_ADDR, prodsig, sizeof (prodsig)))
+    return_errinfo (XPDI_ERR_READ, "failed to read production signature");
+  manifest_device_id (prodsig, id);
+
+  // file i/o, which the target won't wait out unclocked
+  if (!pdi_keepalive_begin (s->ctx))
+    return_errinfo (XPDI_ERR_OPEN,
+      "manifests need a spare core for the keep-alive");
+  load_manifest (s->manifest_dir.c_str (), id, s->manifest);
+  pdi_keepalive_end (s->ctx);
+  s->device_known = !s->manifest.pages.empty ();
+  return s->device_known ? detect_range_crc (s) : XPDI_OK;
+}
+
+
+// the session is now attached to a (possibly different) target
+static int attached (xpdi_session_t *s)
+{
+  s->is_open = true;
+  s->failed = false;
+  s->chip_erased = false;
+  // keeping the reserved room
+  s->manifest.id.clear ();
+  s->manifest.pages.clear ();
+  s->manifest.dirty = false;
+  s->device_known = s->au_checked = s->range_crc = false;
+  s->trusted = s->stale = false;
+  s->skipped = 0;
+  if (s->manifest_dir.empty () || s->cfg.run_target)
+    return XPDI_OK;
+  return track (s, load_device_manifest (s));
+}
+
+
+int xpdi_open (xpdi_session_t *s)
+{
+  if (s->is_open)
+    return_errinfo (XPDI_ERR_USAGE, "session already open");
+  telemetry_set_phase (s->tm, TM_OPEN);
+  // a failed open still needs closing, to release the pins and RT
+  s->is_open = true;
+  if (!pdi_open (s->ctx) || (!s->cfg.run_target && !nvm_wait_enabled (s->ctx)))
+  {
+    s->failed = true;
+    return XPDI_ERR_OPEN;
+  }
+  return attached (s);
+}
+
+
+int xpdi_probe (xpdi_session_t *s, bool stay_open)
+{
+  if (s->is_open)
+    return_errinfo (XPDI_ERR_USAGE, "session already open");
+  pdi_set_timeout (s->ctx, PROBE_TIMEOUT_TICKS);
+  bool present = pdi_open (s->ctx) &&
+    (s->cfg.run_target || nvm_wait_enabled (s->ctx));
+  if (present && stay_open)
+  {
+    pdi_set_timeout (s->ctx, PDI_DEFAULT_TIMEOUT_TICKS);
+    return attached (s);
+  }
+  // still on the short timeout, so an empty socket doesn't cost the full
+  // one for the detach sequence
+  pdi_close (s->ctx);
+  pdi_set_timeout (s->ctx, PDI_DEFAULT_TIMEOUT_TICKS);
+  if (!present)
+    return_errinfo (XPDI_ERR_OPEN, "no target present");
+  return XPDI_OK;
+}
+
+
+int xpdi_present (xpdi_session_t *s)
+{
+  if (s->is_open)
+    return_errinfo (XPDI_ERR_USAGE, "session already open");
+  // the control register was just written by pdi_open(), so reading it back
+  // shows something is there
+  static const char read_control = LDCS | PDI_REG_CONTROL;
+  char control = 0;
+  pdi_set_timeout (s->ctx, PROBE_TIMEOUT_TICKS);
+  pdi_set_run_target (s->ctx, true);
+  bool present = pdi_open (s->ctx) &&
+    pdi_sendrecv (s->ctx, &read_control, 1, &control, 1) && control == 0x07;
+  pdi_close (s->ctx);
+  pdi_set_run_target (s->ctx, s->cfg.run_target);
+  pdi_set_timeout (s->ctx, PDI_DEFAULT_TIMEOUT_TICKS);
+  if (!present)
+    return_errinfo (XPDI_ERR_OPEN, "no target present");
+  return XPDI_OK;
+}
+
+
+int xpdi_close (xpdi_session_t *s)
+{
+  if (!s->is_open)
+    return XPDI_OK;
+  telemetry_set_phase (s->tm, TM_CLOSE);
+
+  // what's recorded was verified, so it's worth keeping even if a later
+  // operation failed; saving is file i/o, so it's done while the
+  // keep-alive holds the link
+  int ret = XPDI_OK;
+  if (s->manifest.dirty && !s->cfg.dry_run)
+  {
+    bool saved = false;
+    if (!pdi_keepalive_begin (s->ctx))
+      set_errinfo ("manifests need a spare core for the keep-alive", -1);
+    else
+    {
+      saved = save_manifest (s->manifest_dir.c_str (), s->manifest);
+      pdi_keepalive_end (s->ctx);
+    }
+    if (!saved)
+    {
+      s->failed = true;
+      ret = XPDI_ERR_WRITE;
+    }
+  }
+  s->manifest.dirty = false;
+
+  pdi_close (s->ctx);
+  s->is_open = false;
+  telemetry_set_phase (s->tm, s->failed ? TM_FAILED : TM_DONE);
+  return ret;
+}
+
+
+void xpdi_fail (xpdi_session_t *s)
+{
+  s->failed = true;
+}
+
+
+int xpdi_read (xpdi_session_t *s, uint32_t addr, char *buf, uint32_t len)
+{
+  if (!check_open (s))
+    return XPDI_ERR_USAGE;
+  telemetry_set_phase (s->tm, TM_READ);
+  if (!nvm_read (s->ctx, s->region.base + addr, buf, len))
+    return track (s, XPDI_ERR_READ);
+  return XPDI_OK;
+}
+
+
+int xpdi_chip_erase (xpdi_session_t *s)
+{
+  if (!check_open (s))
+    return XPDI_ERR_USAGE;
+  telemetry_set_phase (s->tm, TM_ERASE);
+  if (!nvm_chip_erase (s->ctx))
+  {
+    set_errinfo ("failed to perform chip erase", -1);
+    return track (s, XPDI_ERR_CHIP_ERASE);
+  }
+  s->chip_erased = true;
+  manifest_forget (s->manifest, 0, 0xffffffff);
+  return XPDI_OK;
+}
+
+
+int xpdi_patch_usersig (
+  xpdi_session_t *s, uint32_t offs, const char *buf, uint32_t len)
+{
+  if (!check_open (s))
+    return XPDI_ERR_USAGE;
+  if (offs > NVM_USERSIG_SIZE || len > NVM_USERSIG_SIZE - offs)
+    return_errinfo (XPDI_ERR_USAGE, "patch outside the user signature row");
+
+  int ret = XPDI_OK;
+  telemetry_set_phase (s->tm, TM_PROGRAM);
+  if (!nvm_read (s->ctx, NVM_USERSIG_ADDR, s->usersig, NVM_USERSIG_SIZE))
+    ret = XPDI_ERR_READ;
+  else
+  {
+    memcpy (s->usersig + offs, buf, len);
+    if (!nvm_rewrite_usersig (s->ctx, s->usersig, NVM_USERSIG_SIZE))
+      ret = XPDI_ERR_USERSIG;
+  }
+  if (ret)
+    set_errinfo ("failed to patch user signature row", -1);
+  return track (s, ret);
+}
+
+
+int xpdi_image_load (const char *fname, xpdi_image_t **pimg)
+{
+  xpdi_image_t *img = new xpdi_image_t ();
+  if (!load_image (fname, img->storage, img->img, img->pages))
+  {
+    delete img;
+    return XPDI_ERR_IMAGE;
+  }
+  if (!img->img.map)
+    page_entries (img->pages, img->entries);
+  *pimg = img;
+  return XPDI_OK;
+}
+
+
+void xpdi_image_free (xpdi_image_t *img)
+{
+  if (!img)
+    return;
+  unmap_image (img->img);
+  delete img;
+}
+
+
+const page_list_t &xpdi_image_pages (const xpdi_image_t *img)
+{
+  return img->pages;
+}
+
+
+bool xpdi_image_base (const xpdi_image_t *img, uint32_t *base)
+{
+  if (!img->img.map)
+    return false;
+  *base = img->img.hdr->base;
+  return true;
+}
+
+
+flash_region_t xpdi_region (const xpdi_session_t *s)
+{
+  return s->region;
+}
+
+
+// the manifest entry for a page it records with the same contents, if any
+static const image_page_t *unchanged (
+  const manifest_t &m, uint32_t addr, const page_ref_t &p)
+{
+  const image_page_t *e = manifest_find (m, addr);
+  if (!e)
+    return 0;
+  uint64_t hash = p.entry ? p.entry->hash : page_hash (p.data, IMAGE_PAGE_SIZE);
+  return e->hash == hash ? e : 0;
+}
+
+
+// confirms the manifest still describes the device, by comparing an
+// on-chip CRC of a few pages it claims are unchanged, spread across the
+// image; sets s->trusted accordingly
+static int spot_check (xpdi_session_t *s, const page_list_t &pages)
+{
+  s->trusted = false;
+  uint32_t candidates = 0;
+  for (auto &p : pages)
+    if (unchanged (s->manifest, s->region.base + p.addr, p))
+      ++candidates;
+  if (!candidates)
+    return XPDI_OK; // nothing to skip anyway
+
+  uint32_t checks =
+    candidates < SPOT_CHECK_PAGES ? candidates : SPOT_CHECK_PAGES;
+  uint32_t i = 0, c = 0;
+  telemetry_set_phase (s->tm, TM_READ);
+  for (auto &p : pages)
+  {
+    uint32_t addr = s->region.base + p.addr;
+    const image_page_t *e = unchanged (s->manifest, addr, p);
+    if (!e || i++ != c * candidates / checks)
+      continue;
+    ++c;
+    uint32_t crc;
+    if (!nvm_range_crc (s->ctx, addr, addr + IMAGE_PAGE_SIZE - 1, &crc))
+      return_errinfoloc (
+        XPDI_ERR_SPOT_CHECK, "failed to spot check page at address", p.addr);
+    if (crc != (e->crc & 0xffffff))
+    {
+      s->stale = true;
+      manifest_forget (s->manifest, 0, 0xffffffff);
+      return XPDI_OK;
+    }
+  }
+  s->trusted = true;
+  return XPDI_OK;
+}
+
+
+static int program_pages (
+  xpdi_session_t *s, const page_list_t &pages, plan_t &plan, bool *blank)
+{
+  pdi_ctx_t *ctx = s->ctx;
+  const flash_region_t &region = s->region;
+  manifest_t &m = s->manifest;
+  bool recording = !s->manifest_dir.empty ();
+  s->skipped = 0;
+
+  if (plan.kind == PLAN_SECTION_ERASE_WRITE)
+  {
+    telemetry_set_phase (s->tm, TM_ERASE);
+    manifest_forget (m, region.base, region.base + region.size);
+    if (!nvm_erase_section (ctx, region.base, region.boot))
+      return_errinfo (XPDI_ERR_SECTION_ERASE, "failed to erase section");
+  }
+
+  // only the per-page plan leaves pages alone; it also makes a blank
+  // check pointless once the device is known to hold pages of the image
+  if (recording && plan.kind == PLAN_ERASE_WRITE && s->range_crc)
+  {
+    int ret = spot_check (s, pages);
+    if (ret)
+      return ret;
+    if (s->trusted)
+      plan.blank_check = false;
+  }
+
+  // on anything but an AU part the section CRC isn't the CRC-32 the blank
+  // value is worked out for, so it would never match
+  if (plan.blank_check)
+  {
+    int ret = detect_range_crc (s);
+    if (ret)
+      return ret;
+    plan.blank_check = s->range_crc;
+  }
+
+  if (plan.blank_check)
+  {
+    uint32_t crc;
+    if (!nvm_section_crc (ctx, region.boot, &crc))
+      return_errinfo (XPDI_ERR_BLANK_CHECK, "failed to blank check section");
+    *blank = (crc == plan_blank_crc (region.size));
+    if (*blank)
+    {
+      plan.kind = PLAN_WRITE_ONLY;
+      manifest_forget (m, region.base, region.base + region.size);
+    }
+  }
+
+  uint32_t n = 0;
+  telemetry_set_phase (s->tm, TM_PROGRAM);
+  for (auto &p : pages)
+  {
+    uint32_t addr = region.base + p.addr;
+    bool ok = true;
+    telemetry_set_page (s->tm, n++, pages.size ());
+    if (s->trusted && unchanged (m, addr, p))
+    {
+      ++s->skipped;
+      continue;
+    }
+    if (recording)
+      manifest_forget (m, addr, addr + IMAGE_PAGE_SIZE);
+
+    if (page_is_blank (p.data, IMAGE_PAGE_SIZE))
+    {
+      if (plan.kind == PLAN_ERASE_WRITE)
+        ok = nvm_erase_page (ctx, addr);
+    }
+    else if (plan.kind == PLAN_ERASE_WRITE)
+      ok = nvm_rewrite_page (ctx, addr, p.data, IMAGE_PAGE_SIZE);
+    else
+      ok = nvm_write_page (ctx, addr, p.data, IMAGE_PAGE_SIZE);
+    if (!ok)
+      return_errinfoloc (
+        XPDI_ERR_PROGRAM, "failed to rewrite page at address", p.addr);
+
+    if (recording)
+    {
+      if (!nvm_read (ctx, addr, s->page_buf, IMAGE_PAGE_SIZE))
+        return_errinfoloc (
+          XPDI_ERR_READ, "failed to read page at address", p.addr);
+      // a dry run only gets to count the read
+      if (memcmp (s->page_buf, p.data, IMAGE_PAGE_SIZE) != 0 &&
+          !s->cfg.dry_run)
+        return_errinfoloc (
+          XPDI_ERR_VERIFY, "verify failed for page at address", p.addr);
+      manifest_record (m, addr, p);
+    }
+  }
+  return XPDI_OK;
+}
+
+
+int xpdi_program (
+  xpdi_session_t *s, const page_list_t &pages, plan_t &plan, bool *blank)
+{
+  if (!check_open (s))
+    return XPDI_ERR_USAGE;
+  *blank = false;
+  return track (s, program_pages (s, pages, plan, blank));
+}
+
+
+// adds a differing range, merging it with the previous one if it carries
+// on from there (across a page boundary); end is just past that one
+static void add_range (
+  xpdi_check_t *res, uint32_t &end, uint32_t addr, uint32_t len)
+{
+  res->bad_bytes += len;
+  if (res->nranges && addr == end)
+  {
+    if (res->nranges <= XPDI_CHECK_MAX_RANGES)
+      res->ranges[res->nranges - 1].len += len;
+  }
+  else if (res->nranges++ < XPDI_CHECK_MAX_RANGES)
+  {
+    res->ranges[res->nranges - 1].addr = addr;
+    res->ranges[res->nranges - 1].len = len;
+  }
+  end = addr + len;
+}
+
+
+static void diff_page (
+  xpdi_check_t *res, uint32_t &end, const page_ref_t &p, const char *got)
+{
+  size_t i = first_diff (got, p.data, 0, IMAGE_PAGE_SIZE);
+  while (i < IMAGE_PAGE_SIZE)
+  {
+    size_t j = first_same (got, p.data, i, IMAGE_PAGE_SIZE);
+    add_range (res, end, p.addr + i, j - i);
+    i = first_diff (got, p.data, j, IMAGE_PAGE_SIZE);
+  }
+}
+
+
+// rewrites a page found to differ, then reads it back
+static int reflash_page (xpdi_session_t *s, const page_ref_t &p, bool *fixed)
+{
+  uint32_t addr = s->region.base + p.addr;
+  telemetry_set_phase (s->tm, TM_PROGRAM);
+  bool ok = page_is_blank (p.data, IMAGE_PAGE_SIZE) ?
+    nvm_erase_page (s->ctx, addr) :
+    nvm_rewrite_page (s->ctx, addr, p.data, IMAGE_PAGE_SIZE);
+  if (!ok)
+    return_errinfoloc (
+      XPDI_ERR_PROGRAM, "failed to rewrite page at address", p.addr);
+  telemetry_set_phase (s->tm, TM_READ);
+  if (!nvm_read (s->ctx, addr, s->page_buf, IMAGE_PAGE_SIZE))
+    return_errinfoloc (XPDI_ERR_READ, "failed to read page at address", p.addr);
+  *fixed = memcmp (s->page_buf, p.data, IMAGE_PAGE_SIZE) == 0;
+  return XPDI_OK;
+}
+
+
+static int check_pages (xpdi_session_t *s, const page_list_t &pages,
+  unsigned flags, xpdi_check_t *res)
+{
+  memset (res, 0, sizeof (*res));
+  uint32_t end = 0;
+  int ret = XPDI_OK;
+  bool recording = !s->manifest_dir.empty ();
+  telemetry_set_phase (s->tm, TM_READ);
+  for (size_t i = 0; i < pages.size (); )
+  {
+    // back-to-back bursts cost just a REPEAT and LD each (see nvm_read()),
+    // and comparing one takes far less time than the target will wait for
+    // the next clock
+    uint32_t n = 1;
+    while (n < XPDI_CHECK_BURST_PAGES && i + n < pages.size () &&
+           pages[i + n].addr == pages[i].addr + n * IMAGE_PAGE_SIZE)
+      ++n;
+    if (!nvm_read (s->ctx, s->region.base + pages[i].addr, s->burst_buf,
+        n * IMAGE_PAGE_SIZE))
+      return_errinfoloc (
+        XPDI_ERR_READ, "failed to read page at address", pages[i].addr);
+
+    for (uint32_t k = 0; k < n; ++k, ++i)
+    {
+      const page_ref_t &p = pages[i];
+      uint32_t addr = s->region.base + p.addr;
+      const char *got = s->burst_buf + k * IMAGE_PAGE_SIZE;
+      telemetry_set_page (s->tm, i, pages.size ());
+      ++res->pages;
+
+      // a dry run only gets to count the reads
+      bool good = s->cfg.dry_run || memcmp (got, p.data, IMAGE_PAGE_SIZE) == 0;
+      if (!good)
+      {
+        ++res->bad_pages;
+        diff_page (res, end, p, got);
+        if (flags & XPDI_CHECK_REFLASH)
+        {
+          int err = reflash_page (s, p, &good);
+          if (err)
+            return err;
+          res->reflashed += good;
+        }
+      }
+      if (good)
+      {
+        if (recording)
+          manifest_record (s->manifest, addr, p);
+        continue;
+      }
+
+      if (recording)
+        manifest_forget (s->manifest, addr, addr + IMAGE_PAGE_SIZE);
+      if (!ret)
+      {
+        set_errinfo ("verify failed for page at address", p.addr);
+        ret = XPDI_ERR_VERIFY;
+      }
+      if (flags & XPDI_CHECK_STOP_FIRST)
+        return ret;
+    }
+  }
+  return ret;
+}
+
+
+int xpdi_verify (xpdi_session_t *s, const page_list_t &pages)
+{
+  xpdi_check_t res;
+  return xpdi_check (s, pages, XPDI_CHECK_STOP_FIRST, &res);
+}
+
+
+int xpdi_check (xpdi_session_t *s, const page_list_t &pages, unsigned flags,
+  xpdi_check_t *res)
+{
+  if (!check_open (s))
+    return XPDI_ERR_USAGE;
+  return track (s, check_pages (s, pages, flags, res));
+}
+
+
+int xpdi_program_image (
+  xpdi_session_t *s, const xpdi_image_t *img, unsigned flags)
+{
+  uint32_t base;
+  if (xpdi_image_base (img, &base) && base != s->region.base)
+    return_errinfo (
+      XPDI_ERR_USAGE, "compiled image is for a different base address");
+
+  plan_t plan = plan_programming (img->pages, s->region, s->chip_erased,
+    flags & XPDI_ERASE_SECTION, s->cfg.delay_us);
+  bool blank;
+  int ret = xpdi_program (s, img->pages, plan, &blank);
+  if (!ret && (flags & XPDI_VERIFY) && s->manifest_dir.empty ())
+    ret = xpdi_verify (s, img->pages);
+  return ret;
+}
+
+
+int xpdi_verify_image (xpdi_session_t *s, const xpdi_image_t *img)
+{
+  return xpdi_verify (s, img->pages);
+}
+
+
+int xpdi_check_image (xpdi_session_t *s, const xpdi_image_t *img,
+  unsigned flags, xpdi_check_t *res)
+{
+  return xpdi_check (s, img->pages, flags, res);
+}
+
+
+bool xpdi_manifest_status (
+  const xpdi_session_t *s, xpdi_manifest_status_t *st)
+{
+  if (s->manifest_dir.empty () || s->manifest.id.empty ())
+    return false;
+  memset (st, 0, sizeof (*st));
+  strncpy (st->device_id, s->manifest.id.c_str (), sizeof (st->device_id) - 1);
+  st->known = s->device_known;
+  st->stale = s->stale;
+  st->unchecked = s->device_known && !s->range_crc;
+  st->skipped = s->skipped;
+  return true;
+}
+
+
+void xpdi_error (const char **msg, int *loc)
+{
+  get_errinfo (msg, loc);
+}
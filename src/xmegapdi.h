@@ -0,0 +1,217 @@
+/* Copyright (C) 2015 DiUS Computing Pty. Ltd.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#ifndef _XMEGAPDI_H_
+#define _XMEGAPDI_H_
+
+// libxmegapdi: a programming session on one target, for embedding in other
+// programs. A session is opened once, then any number of reads, erases,
+// programs and verifies run within the same PDI attachment, then it's
+// closed. The pdi tool is itself a client of this API.
+//
+// Between xpdi_open() and xpdi_close() the calling thread runs realtime and
+// the link must be kept clocked: do slow things (file i/o, printing) before
+// opening, or hold the link with pdi_keepalive_begin() on xpdi_ctx() while
+// doing them. The lower layers (pdi.h, nvm.h) remain available through
+// xpdi_ctx() for anything not covered here.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "pdi.h"
+
+// operation results, which double as the pdi tool's exit codes; on failure
+// the reason is available from xpdi_error()
+enum
+{
+  XPDI_OK                = 0,
+  XPDI_ERR_USAGE         = 1,
+  XPDI_ERR_IMAGE         = 2,
+  XPDI_ERR_INIT          = 3,
+  XPDI_ERR_OPEN          = 4,
+  XPDI_ERR_TELEMETRY     = 5,
+  XPDI_ERR_TRACE         = 6,
+  XPDI_ERR_WRITE         = 8,
+  XPDI_ERR_READ          = 10,
+  XPDI_ERR_CHIP_ERASE    = 11,
+  XPDI_ERR_PROGRAM       = 12,
+  XPDI_ERR_SECTION_ERASE = 13,
+  XPDI_ERR_BLANK_CHECK   = 14,
+  XPDI_ERR_VERIFY        = 15,
+  XPDI_ERR_USERSIG       = 16,
+  XPDI_ERR_SPOT_CHECK    = 18
+};
+
+typedef struct
+{
+  uint8_t clk_pin, data_pin;
+  uint16_t delay_us;
+  uint32_t flash_base;       // PDI address; 0x800000 app, 0x840000 boot
+  bool dry_run;              // count and model, never touch gpio
+  bool run_target;           // attach only, leaving the target running
+  const char *telemetry_shm; // publish progress there, may be null
+  uint32_t trace_records;    // capture a bus trace of this size, 0 for none
+  const char *manifest_dir;  // keep device manifests there, may be null
+} xpdi_config_t;
+
+typedef struct xpdi_session xpdi_session_t;
+typedef struct xpdi_image xpdi_image_t;
+
+// x256 app flash on j8.18/j8.40, full speed, no telemetry or trace
+void xpdi_default_config (xpdi_config_t *cfg);
+
+// sets up a session without touching the target; all allocation happens
+// here, so nothing allocates while the session is open. That includes
+// manifest storage, which is reserved for all of an XMEGA256's flash; the
+// exception is stdio's own buffers for the manifest file.
+int xpdi_new (const xpdi_config_t *cfg, xpdi_session_t **s);
+
+// closes the session first if need be
+void xpdi_free (xpdi_session_t *s);
+
+pdi_ctx_t *xpdi_ctx (xpdi_session_t *s);
+
+// enters PDI mode and, unless run_target is set, waits for NVM access
+int xpdi_open (xpdi_session_t *s);
+
+// like xpdi_open(), but gives up quickly if no target answers; a target
+// that does is left open only if stay_open is set
+int xpdi_probe (xpdi_session_t *s, bool stay_open);
+
+// checks that a target answers on the PDI, attaching as with run_target so
+// it is never reset, which makes it cheap enough to poll for a board being
+// removed; XPDI_ERR_OPEN if nothing answers
+int xpdi_present (xpdi_session_t *s);
+
+// saves the device manifest if it changed, which is the only way for
+// closing to fail; then reports the session DONE, or FAILED if any
+// operation failed since open
+int xpdi_close (xpdi_session_t *s);
+
+// marks the open session failed, for errors the caller ran into itself
+void xpdi_fail (xpdi_session_t *s);
+
+// addr is relative to the flash base
+int xpdi_read (xpdi_session_t *s, uint32_t addr, char *buf, uint32_t len);
+
+int xpdi_chip_erase (xpdi_session_t *s);
+
+// reads the user signature row, replaces len bytes at offs and rewrites it
+int xpdi_patch_usersig (
+  xpdi_session_t *s, uint32_t offs, const char *buf, uint32_t len);
+
+// loads an ihex file or a compiled image; best done before opening
+int xpdi_image_load (const char *fname, xpdi_image_t **img);
+
+void xpdi_image_free (xpdi_image_t *img);
+
+// flags for xpdi_program_image()
+#define XPDI_ERASE_SECTION 0x01 // may erase the whole section if cheaper
+#define XPDI_VERIFY        0x02 // read back every page afterwards
+
+// programs img using the cheapest plan, taking a chip erase earlier in the
+// session into account; with a device manifest, pages are verified as they
+// are written, making XPDI_VERIFY redundant
+int xpdi_program_image (
+  xpdi_session_t *s, const xpdi_image_t *img, unsigned flags);
+
+int xpdi_verify_image (xpdi_session_t *s, const xpdi_image_t *img);
+
+// A verify that finds every difference rather than just the first bad
+// page. Consecutive pages are read back in bursts of up to
+// XPDI_CHECK_BURST_PAGES, each compared as soon as it has arrived, so the
+// check takes about as long as the transfer itself. Differences are
+// reported as exact byte ranges.
+#define XPDI_CHECK_BURST_PAGES 32
+#define XPDI_CHECK_MAX_RANGES  64
+
+// flags for xpdi_check_image()
+#define XPDI_CHECK_STOP_FIRST 0x01 // stop after the first bad page
+#define XPDI_CHECK_REFLASH    0x02 // rewrite bad pages, and check them again
+
+typedef struct
+{
+  uint32_t addr, len; // addr is relative to the flash base
+} xpdi_range_t;
+
+typedef struct
+{
+  uint32_t pages;     // pages compared
+  uint32_t bad_pages; // pages that differed
+  uint32_t reflashed; // ...of which rewritten and now good
+  uint32_t bad_bytes;
+  uint32_t nranges;   // differing ranges, of which the first
+                      // XPDI_CHECK_MAX_RANGES are kept
+  xpdi_range_t ranges[XPDI_CHECK_MAX_RANGES];
+} xpdi_check_t;
+
+// XPDI_ERR_VERIFY if any page (still) differs, the first one reported
+// through xpdi_error()
+int xpdi_check_image (xpdi_session_t *s, const xpdi_image_t *img,
+  unsigned flags, xpdi_check_t *res);
+
+// With a manifest directory configured, opening a session reads the
+// device's production signature and loads what was last verifiably written
+// to that very part. Programming then skips pages whose contents are
+// unchanged, provided an on-chip CRC of a few of them confirms the manifest
+// still matches the device (the per-page erase+write plan only; erasing
+// sections or the chip starts afresh). Everything that does get written is
+// read back straight away and recorded, as are verified pages. That CRC is
+// only found on XMEGA AU parts; others are told apart on open, and their
+// manifests are kept up to date but never used to skip pages. The manifest
+// file is read on open and saved on close with the keep-alive holding the
+// link, so both fail if it can't run (no spare core, or a lock-step lane).
+typedef struct
+{
+  char device_id[26]; // lot-wafer-x-y, see manifest.h
+  bool known;         // a manifest was found for the device
+  bool stale;         // ...but the spot check found it out of date
+  bool unchecked;     // ...but the part can't spot check it (it isn't an
+                      // XMEGA AU), so it went unused
+  uint32_t skipped;   // unchanged pages left alone by the last program
+} xpdi_manifest_status_t;
+
+// false if the session doesn't keep a manifest, or isn't attached yet
+bool xpdi_manifest_status (
+  const xpdi_session_t *s, xpdi_manifest_status_t *st);
+
+// this thread's last error, and its location (-1 if none applies)
+void xpdi_error (const char **msg, int *loc);
+
+#ifdef __cplusplus
+}
+
+#include "plan.h"
+
+// --- C++ API, for callers that manage their own page lists and plans ---
+
+const page_list_t &xpdi_image_pages (const xpdi_image_t *img);
+
+// the base a compiled image was built for; false for ihex images
+bool xpdi_image_base (const xpdi_image_t *img, uint32_t *base);
+
+flash_region_t xpdi_region (const xpdi_session_t *s);
+
+// programs pages according to plan; *blank tells whether a blank check
+// found the section blank, in which case plan is downgraded to write-only
+int xpdi_program (
+  xpdi_session_t *s, const page_list_t &pages, plan_t &plan, bool *blank);
+
+// reads back every page and compares
+int xpdi_verify (xpdi_session_t *s, const page_list_t &pages);
+
+// see xpdi_check_image()
+int xpdi_check (xpdi_session_t *s, const page_list_t &pages, unsigned flags,
+  xpdi_check_t *res);
+#endif
+
+#endif
@@ -0,0 +1,631 @@
+/* Copyright (C) 2015 DiUS Computing Pty. Ltd.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+// Host side test and benchmark for the ihex loader; needs neither bcm2835
+// nor a target. Synthetic images are loaded and compared against a model
+// of the page layout, and the fuzzer throws mutated images at both the
+// loader and a deliberately simple reference parser, which must agree.
+//
+// usage: ihex-test [seed]
+
+#include "ihex.h"
+#include "errinfo.h"
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <new>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <time.h>
+
+// counts every allocation, so the benchmark can report them per image
+static unsigned long allocs = 0;
+
+void *operator new (size_t sz)
+{
+  ++allocs;
+  void *p = malloc (sz ? sz : 1);
+  if (!p)
+    throw std::bad_alloc ();
+  return p;
+}
+
+void operator delete (void *p) noexcept
+{
+  free (p);
+}
+
+
+static unsigned failures = 0;
+
+#define check(cond, ...) \
+  do { \
+    if (!(cond)) { printf ("FAIL: " __VA_ARGS__); printf ("\n"); ++failures; } \
+  } while (0)
+
+
+// xorshift32, so a seed reproduces a run exactly
+static uint32_t rng_state = 1;
+
+static uint32_t rnd ()
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= rng_state << 5;
+  return rng_state;
+}
+
+static uint32_t rnd (uint32_t n)
+{
+  return rnd () % n;
+}
+
+
+struct record_t
+{
+  uint8_t type;
+  uint16_t addr;
+  std::vector<uint8_t> data;
+};
+typedef std::vector<record_t> records_t;
+
+// what an image should put where, byte by byte
+typedef std::map<uint32_t, uint8_t> byte_model_t;
+
+enum ext_t { EXT_LINEAR, EXT_SEGMENT };
+
+
+static record_t make_record (uint8_t type, uint16_t addr, const uint8_t *data, unsigned n)
+{
+  record_t r;
+  r.type = type;
+  r.addr = addr;
+  r.data.assign (data, data + n);
+  return r;
+}
+
+
+// splits the model into data records of at most reclen bytes, preceded by
+// an extended address record whenever the current base can't reach. Linear
+// (04) bases are 64k aligned; segment (02) bases are put just below the data
+// to exercise the x16 scaling, which limits them to the first 1MB.
+static records_t to_records (const byte_model_t &bytes, unsigned reclen, ext_t ext)
+{
+  records_t recs;
+  uint32_t base = 0;
+  std::vector<uint8_t> run;
+  auto it = bytes.begin ();
+  while (it != bytes.end ())
+  {
+    uint32_t addr = it->first;
+    if (addr < base || addr - base > 0xffff)
+    {
+      uint8_t ea[2];
+      if (ext == EXT_LINEAR)
+      {
+        base = addr & ~0xffffu;
+        ea[0] = base >> 24;
+        ea[1] = base >> 16;
+      }
+      else
+      {
+        base = addr & ~0xfu;
+        ea[0] = base >> 12;
+        ea[1] = base >> 4;
+      }
+      recs.push_back (make_record (ext == EXT_LINEAR ? 0x04 : 0x02, 0, ea, 2));
+    }
+
+    run.clear ();
+    uint32_t next = addr;
+    while (it != bytes.end () && it->first == next &&
+           run.size () < reclen && next - base <= 0xffff)
+    {
+      run.push_back (it->second);
+      ++it;
+      ++next;
+    }
+    recs.push_back (make_record (0x00, addr - base, run.data (), run.size ()));
+  }
+  recs.push_back (make_record (0x01, 0, 0, 0));
+  return recs;
+}
+
+
+static void put_byte (std::string &out, uint8_t b)
+{
+  static const char hex[] = "0123456789ABCDEF";
+  out += hex[b >> 4];
+  out += hex[b & 15];
+}
+
+static std::string render (const records_t &recs)
+{
+  std::string out;
+  for (auto &r : recs)
+  {
+    uint8_t hdr[4] =
+      { (uint8_t)r.data.size (), (uint8_t)(r.addr >> 8), (uint8_t)r.addr, r.type };
+    uint8_t sum = 0;
+    out += ':';
+    for (uint8_t b : hdr)
+    {
+      put_byte (out, b);
+      sum += b;
+    }
+    for (uint8_t b : r.data)
+    {
+      put_byte (out, b);
+      sum += b;
+    }
+    put_byte (out, -sum);
+    out += '\n';
+  }
+  return out;
+}
+
+
+static int hexval (char c)
+{
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// the format rules load_ihex() applies, written for obviousness rather
+// than speed: decode the whole record, then look at it
+static bool ref_parse (const std::string &text, byte_model_t &bytes)
+{
+  uint32_t base = 0;
+  size_t pos = 0;
+  while (pos < text.size ())
+  {
+    size_t eol = text.find ('\n', pos);
+    if (eol == std::string::npos)
+      eol = text.size ();
+    std::string line = text.substr (pos, eol - pos);
+    pos = eol + 1;
+
+    while (!line.empty () &&
+           (line.back () == ' ' || line.back () == '\t' || line.back () == '\r'))
+      line.pop_back ();
+    if (line.size () < 11 || line[0] != ':' || line.size () % 2 == 0)
+      return false;
+
+    std::vector<uint8_t> rec;
+    uint8_t sum = 0;
+    for (size_t i = 1; i < line.size (); i += 2)
+    {
+      int hi = hexval (line[i]), lo = hexval (line[i + 1]);
+      if (hi < 0 || lo < 0)
+        return false;
+      rec.push_back (hi << 4 | lo);
+      sum += rec.back ();
+    }
+    if (rec.size () != 5u + rec[0] || sum != 0)
+      return false;
+
+    uint32_t addr = rec[1] << 8 | rec[2];
+    switch (rec[3])
+    {
+      case 0x00:
+        for (unsigned i = 0; i < rec[0]; ++i)
+          bytes[base + addr + i] = rec[4 + i];
+        break;
+      case 0x01:
+        return true;
+      case 0x02:
+        if (rec[0] != 2)
+          return false;
+        base = (uint32_t)(rec[4] << 8 | rec[5]) * 16;
+        break;
+      case 0x04:
+        if (rec[0] != 2)
+          return false;
+        base = (uint32_t)(rec[4] << 8 | rec[5]) << 16;
+        break;
+    }
+  }
+  return false;
+}
+
+
+// the reference page layout: every byte lands in the 512 byte page
+// containing it, the rest of each touched page stays erased
+static page_map_512_t expected_pages (const byte_model_t &bytes)
+{
+  page_map_512_t pages;
+  for (auto &b : bytes)
+  {
+    uint32_t pgaddr = b.first & ~511u;
+    auto &pg = pages[pgaddr];
+    pg.addr = pgaddr;
+    pg.data[b.first - pgaddr] = b.second;
+  }
+  return pages;
+}
+
+// empty if the layouts match, otherwise the first difference
+static std::string layout_diff (const page_map_512_t &got, const page_map_512_t &want)
+{
+  char buf[100];
+  auto g = got.begin ();
+  auto w = want.begin ();
+  for (; g != got.end () && w != want.end (); ++g, ++w)
+  {
+    if (g->first != w->first)
+    {
+      snprintf (buf, sizeof (buf), "page 0x%08x where 0x%08x expected",
+        g->first, w->first);
+      return buf;
+    }
+    if (g->second.addr != g->first)
+    {
+      snprintf (buf, sizeof (buf), "page 0x%08x tagged with address 0x%08x",
+        g->first, g->second.addr);
+      return buf;
+    }
+    for (unsigned i = 0; i < 512; ++i)
+    {
+      if (g->second.data[i] != w->second.data[i])
+      {
+        snprintf (buf, sizeof (buf), "byte 0x%08x is 0x%02x, expected 0x%02x",
+          g->first + i, (uint8_t)g->second.data[i], (uint8_t)w->second.data[i]);
+        return buf;
+      }
+    }
+  }
+  if (g != got.end ())
+  {
+    snprintf (buf, sizeof (buf), "unexpected page 0x%08x", g->first);
+    return buf;
+  }
+  if (w != want.end ())
+  {
+    snprintf (buf, sizeof (buf), "missing page 0x%08x", w->first);
+    return buf;
+  }
+  return std::string ();
+}
+
+
+static bool load (const std::string &text, page_map_512_t &pages)
+{
+  std::istringstream is (text);
+  return load_ihex (is, pages);
+}
+
+static void check_layout (const char *name, const byte_model_t &bytes, unsigned reclen, ext_t ext)
+{
+  page_map_512_t pages;
+  if (!load (render (to_records (bytes, reclen, ext)), pages))
+  {
+    const char *msg;
+    int loc;
+    get_errinfo (&msg, &loc);
+    check (false, "%s: rejected, %s %d", name, msg, loc);
+    return;
+  }
+  std::string diff = layout_diff (pages, expected_pages (bytes));
+  check (diff.empty (), "%s: %s", name, diff.c_str ());
+}
+
+
+static void fill (byte_model_t &bytes, uint32_t addr, unsigned len)
+{
+  for (unsigned i = 0; i < len; ++i)
+    bytes[addr + i] = rnd ();
+}
+
+// the application section of an ATxmega256A3, filled
+static byte_model_t dense_image ()
+{
+  byte_model_t b;
+  fill (b, 0, 256*1024);
+  return b;
+}
+
+// small islands scattered over the same section
+static byte_model_t sparse_image ()
+{
+  byte_model_t b;
+  for (unsigned i = 0; i < 64; ++i)
+    fill (b, rnd (256*1024 - 64), 1 + rnd (64));
+  return b;
+}
+
+// islands at odd addresses; cut into odd sized records, most of these
+// straddle a page boundary somewhere
+static byte_model_t unaligned_image ()
+{
+  byte_model_t b;
+  for (unsigned i = 0; i < 256; ++i)
+    fill (b, 0x1f7 + i*1021, 509);
+  return b;
+}
+
+// a page or so in every 64k of the 16MB type 04 records can reach, some of
+// it crossing into the next 64k
+static byte_model_t span_image ()
+{
+  byte_model_t b;
+  fill (b, 0, 512);
+  for (unsigned i = 1; i < 256; ++i)
+    fill (b, i*0x10000 - 0x100 + rnd (0x200), 512);
+  return b;
+}
+
+// islands in the first 1MB, for type 02 records
+static byte_model_t segment_image ()
+{
+  byte_model_t b;
+  for (unsigned i = 0; i < 64; ++i)
+    fill (b, rnd (0x100000 - 1024), 1 + rnd (1024));
+  return b;
+}
+
+// records that start, end and straddle page boundaries
+static byte_model_t boundary_image ()
+{
+  byte_model_t b;
+  fill (b, 0x01f8, 16);   // straddles 0x200
+  fill (b, 0x03f0, 16);   // ends on 0x400, must not touch the next page
+  fill (b, 0x0600, 16);   // starts on a boundary
+  fill (b, 0x09ff, 255);  // one byte in 0x800, the rest only in 0xa00
+  fill (b, 0xfff8, 16);   // straddles 64k, split into two records
+  return b;
+}
+
+
+// 02/04 semantics, checked by hand rather than through the model
+static void check_address_records ()
+{
+  const uint8_t seg[] = { 0x10, 0x01 }, lin[] = { 0x00, 0x0a }, hi[] = { 0xff, 0x00 };
+  const uint8_t d1[] = { 0x55 }, d2[] = { 0xaa }, d3[] = { 0x5a };
+  records_t recs;
+  recs.push_back (make_record (0x02, 0, seg, 2));     // base 0x10010
+  recs.push_back (make_record (0x00, 0x01ff, d1, 1)); // 0x1020f
+  recs.push_back (make_record (0x04, 0, lin, 2));     // base 0x000a0000
+  recs.push_back (make_record (0x00, 0x0010, d2, 1)); // 0x000a0010
+  recs.push_back (make_record (0x04, 0, hi, 2));      // base 0xff000000
+  recs.push_back (make_record (0x00, 0x0200, d3, 1)); // 0xff000200
+  recs.push_back (make_record (0x01, 0, 0, 0));
+
+  page_map_512_t pages;
+  check (load (render (recs), pages), "address records: rejected");
+  check (pages.size () == 3, "address records: %zu pages, expected 3", pages.size ());
+  check (pages.count (0x10200) && (uint8_t)pages[0x10200].data[0x0f] == 0x55,
+    "address records: type 02 base not applied");
+  check (pages.count (0x0a0000) && (uint8_t)pages[0x0a0000].data[0x10] == 0xaa,
+    "address records: type 04 base not applied");
+  check (pages.count (0xff000200) && (uint8_t)pages[0xff000200].data[0] == 0x5a,
+    "address records: type 04 base above 2GB not applied");
+}
+
+
+static std::vector<std::string> split_lines (const std::string &text)
+{
+  std::vector<std::string> lines;
+  std::istringstream is (text);
+  std::string line;
+  while (std::getline (is, line))
+    lines.push_back (line);
+  return lines;
+}
+
+static std::string join_lines (const std::vector<std::string> &lines)
+{
+  std::string text;
+  for (auto &l : lines)
+    text += l + "\n";
+  return text;
+}
+
+// each damaged image must be rejected, blaming the damaged line
+static void check_rejects ()
+{
+  byte_model_t bytes;
+  fill (bytes, 0x1f8, 64);
+  fill (bytes, 0x12345, 64);
+  std::vector<std::string> good = split_lines (render (to_records (bytes, 16, EXT_LINEAR)));
+  const unsigned data_line = 2, ext_line = 4; // 0x218, and the 04 for 0x10000
+
+  struct { const char *what; unsigned line; void (*damage) (std::string &); } cases[] =
+  {
+    { "bad data checksum", data_line,
+      [] (std::string &l) { l.back () = l.back () == '0' ? '1' : '0'; } },
+    { "bad 04 checksum", ext_line,
+      [] (std::string &l) { l.back () = l.back () == '0' ? '1' : '0'; } },
+    { "bad data digit", data_line,
+      [] (std::string &l) { l[9] = 'g'; } },
+    { "bad header digit", data_line,
+      [] (std::string &l) { l[3] = 'x'; } },
+    { "short record", data_line,
+      [] (std::string &l) { l.erase (l.size () - 4, 2); } },
+    { "missing colon", data_line,
+      [] (std::string &l) { l[0] = ';'; } },
+    { "short 04 record", ext_line,
+      [] (std::string &l)
+      {
+        const uint8_t b = 0x01;
+        records_t r (1, make_record (0x04, 0, &b, 1));
+        l = render (r);
+        l.pop_back ();
+      } },
+  };
+
+  for (auto &c : cases)
+  {
+    std::vector<std::string> lines = good;
+    c.damage (lines[c.line]);
+    page_map_512_t pages;
+    bool ok = load (join_lines (lines), pages);
+    const char *msg;
+    int loc;
+    get_errinfo (&msg, &loc);
+    check (!ok, "%s: accepted", c.what);
+    check (ok || loc == (int)c.line, "%s: blamed line %d, not %u", c.what, loc, c.line);
+  }
+
+  std::vector<std::string> lines = good;
+  lines.pop_back ();
+  page_map_512_t pages;
+  check (!load (join_lines (lines), pages), "missing EOF: accepted");
+}
+
+
+// random valid images against the model
+static void fuzz_valid (unsigned rounds)
+{
+  for (unsigned n = 0; n < rounds && !failures; ++n)
+  {
+    byte_model_t bytes;
+    ext_t ext = rnd (2) ? EXT_LINEAR : EXT_SEGMENT;
+    uint32_t limit = ext == EXT_LINEAR ? 0x1000000 : 0x100000;
+    for (unsigned i = 1 + rnd (8); i; --i)
+      fill (bytes, rnd (limit - 1024), 1 + rnd (1024));
+    char name[40];
+    snprintf (name, sizeof (name), "valid image #%u", n);
+    check_layout (name, bytes, 1 + rnd (255), ext);
+  }
+}
+
+// mutated images: the loader and the reference parser must agree on
+// whether to take them, and if so, on the layout
+static void fuzz_mutated (unsigned rounds)
+{
+  static const char junk[] = ":0123456789abcdefABCDEFg \t\r\n";
+  byte_model_t seed;
+  fill (seed, 0x1f0, 40);
+  fill (seed, 0xfff0, 40);
+  const records_t pristine = to_records (seed, 16, EXT_LINEAR);
+
+  for (unsigned n = 0; n < rounds && !failures; ++n)
+  {
+    // record level damage keeps the checksums right, to get past them
+    records_t recs = pristine;
+    for (unsigned i = 1 + rnd (3); i; --i)
+    {
+      record_t &r = recs[rnd (recs.size ())];
+      switch (rnd (4))
+      {
+        case 0: r.type = rnd (4) ? rnd (6) : rnd (256); break;
+        case 1: r.addr = rnd (); break;
+        case 2: r.data.resize (rnd (2) ? rnd (4) : rnd (256), rnd ()); break;
+        case 3: if (!r.data.empty ()) r.data[rnd (r.data.size ())] = rnd (); break;
+      }
+    }
+    std::string text = render (recs);
+
+    // and sometimes at the text level too
+    if (rnd (2))
+    {
+      for (unsigned i = 1 + rnd (3); i; --i)
+      {
+        size_t at = rnd (text.size ());
+        char c = junk[rnd (sizeof (junk) - 1)];
+        switch (rnd (3))
+        {
+          case 0: text[at] = c; break;
+          case 1: text.erase (at, 1); break;
+          case 2: text.insert (at, 1, c); break;
+        }
+      }
+    }
+
+    page_map_512_t pages;
+    byte_model_t bytes;
+    bool got = load (text, pages);
+    bool want = ref_parse (text, bytes);
+    check (got == want, "mutated image #%u: loader %s, reference %s", n,
+      got ? "accepted" : "rejected", want ? "accepted" : "rejected");
+    if (got && want)
+    {
+      std::string diff = layout_diff (pages, expected_pages (bytes));
+      check (diff.empty (), "mutated image #%u: %s", n, diff.c_str ());
+    }
+    if (failures)
+      printf ("%s", text.c_str ());
+  }
+}
+
+
+static double now ()
+{
+  timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void bench (const char *name, const byte_model_t &bytes, unsigned reclen, ext_t ext)
+{
+  std::string text = render (to_records (bytes, reclen, ext));
+  unsigned loads = 0;
+  unsigned long alloc_total = 0;
+  double busy = 0;
+  size_t npages = 0;
+  while (loads < 3 || busy < 0.25)
+  {
+    page_map_512_t pages;
+    std::istringstream is (text);
+    unsigned long allocs_before = allocs;
+    double start = now ();
+    bool ok = load_ihex (is, pages);
+    busy += now () - start;
+    alloc_total += allocs - allocs_before;
+    check (ok, "%s: rejected", name);
+    npages = pages.size ();
+    ++loads;
+  }
+  printf ("  %-10s %8zu bytes %6zu pages %8.1f MB/s %8.1f allocations\n",
+    name, text.size (), npages, text.size () * loads / busy / 1e6,
+    (double)alloc_total / loads);
+}
+
+
+int main (int argc, char *argv[])
+{
+  rng_state = argc > 1 ? strtoul (argv[1], 0, 0) : 1;
+  if (!rng_state)
+    rng_state = 1;
+  printf ("seed %u\n", rng_state);
+
+  byte_model_t dense = dense_image ();
+  byte_model_t sparse = sparse_image ();
+  byte_model_t unaligned = unaligned_image ();
+  byte_model_t span = span_image ();
+  byte_model_t segment = segment_image ();
+
+  check_layout ("dense", dense, 16, EXT_LINEAR);
+  check_layout ("sparse", sparse, 16, EXT_LINEAR);
+  check_layout ("unaligned", unaligned, 13, EXT_LINEAR);
+  check_layout ("span", span, 32, EXT_LINEAR);
+  check_layout ("segment", segment, 16, EXT_SEGMENT);
+  check_layout ("boundary", boundary_image (), 255, EXT_LINEAR);
+  check_address_records ();
+  check_rejects ();
+  fuzz_valid (500);
+  fuzz_mutated (20000);
+
+  printf ("load_ihex, per image (MB/s of ihex text):\n");
+  bench ("dense", dense, 16, EXT_LINEAR);
+  bench ("sparse", sparse, 16, EXT_LINEAR);
+  bench ("unaligned", unaligned, 13, EXT_LINEAR);
+  bench ("span", span, 32, EXT_LINEAR);
+
+  if (failures)
+  {
+    printf ("%u failures\n", failures);
+    return 1;
+  }
+  printf ("ok\n");
+  return 0;
+}